@@ -48,14 +48,14 @@ public:
   }
 
   template <uint32_t Size>
-  size_t selectForReuse(FixedArray<MiniHeap, Size> &miniheaps, pid_t current) {
+  size_t selectForReuse(FixedArray<MiniHeap, Size> &miniheaps, pid_t current, int node = -1) {
     std::lock_guard<std::mutex> lock(_mutex);
 
     size_t bytesFree = 0;
 
     for (int i = kBinnedTrackerBinCount - 1; i >= 0; i--) {
       while (_partial[i].size() > 0) {
-        auto mh = popRandomLocked(_partial[i]);
+        auto mh = popRandomLocked(_partial[i], node);
         // if we didn't find something in popRandom, break out of the
         // while loop and try the next fullness size
         if (unlikely(mh == nullptr)) {
@@ -86,14 +86,19 @@ public:
     return bytesFree;
   }
 
-  internal::vector<MiniHeap *> meshingCandidates(double occupancyCutoff) const {
+  // the partial bins are an occupancy index kept up to date by add,
+  // remove and postFree, so gathering candidates is a walk over the
+  // emptier bins.  bucket is replaced, and callers reuse it across
+  // passes so this doesn't allocate once it has grown.
+  void meshingCandidates(double occupancyCutoff, internal::vector<MiniHeap *> &bucket) const {
     std::lock_guard<std::mutex> lock(_mutex);
 
-    internal::vector<MiniHeap *> bucket{};
+    bucket.clear();
+    bucket.reserve(partialSizeLocked());
 
     // consider all of our partially filled miniheaps
     for (size_t i = 0; i < kBinnedTrackerBinCount; i++) {
-      const auto partial = _partial[i];
+      const auto &partial = _partial[i];
       if (i == kBinnedTrackerBinCount / 2 + 1 && bucket.size() == 0) {
         break;
       }
@@ -103,10 +108,21 @@ public:
           bucket.push_back(mh);
       }
     }
+  }
 
+  internal::vector<MiniHeap *> meshingCandidates(double occupancyCutoff) const {
+    internal::vector<MiniHeap *> bucket{};
+    meshingCandidates(occupancyCutoff, bucket);
     return bucket;
   }
 
+  // lock-free check of whether mh, now holding inUseCount objects,
+  // needs to move to a different bin.  Racy by design: postFree
+  // re-checks under _mutex.
+  inline bool needsRebin(const MiniHeap *mh, uint32_t inUseCount) const {
+    return getBinId(inUseCount) != mh->getBinToken().bin();
+  }
+
   // called after a free through the global heap has happened --
   // miniheap must be unreffed by return
   bool postFree(MiniHeap *mh, uint32_t inUseCount) {
@@ -124,7 +140,12 @@ public:
 
     std::lock_guard<std::mutex> lock(_mutex);
 
-    // double-check
+    // double-check -- frees no longer hold the global heap lock, so
+    // mh may have been attached, or untracked by meshing, since the
+    // check above.
+    if (unlikely(mh->isAttached() || !mh->getBinToken().valid())) {
+      return false;
+    }
     oldBinId = mh->getBinToken().bin();
     newBinId = getBinId(mh->inUseCount());
     if (unlikely(newBinId == oldBinId)) {
@@ -164,6 +185,32 @@ public:
     std::atomic_thread_fence(std::memory_order_release);
   }
 
+  // bytes that perfectly packing our partially full miniheaps would
+  // free, taking each partial bin's occupancy to be the middle of its
+  // range -- cheap enough to call after every mesh pass
+  size_t reclaimableBytes() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    size_t count = 0;
+    double inUse = 0;  // in miniheaps
+    for (size_t i = 0; i < kBinnedTrackerBinCount; i++) {
+      count += _partial[i].size();
+      inUse += _partial[i].size() * (i + 0.5) / kBinnedTrackerBinCount;
+    }
+
+    const auto needed = static_cast<size_t>(inUse) + 1;
+    if (count <= needed)
+      return 0;
+    return (count - needed) * _objectCount * _objectSize;
+  }
+
+  // bytes spanned by our non-empty miniheaps
+  size_t nonEmptyBytes() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return (_full.size() + partialSizeLocked()) * _objectCount * _objectSize;
+  }
+
   size_t allocatedObjectCount() const {
     std::lock_guard<std::mutex> lock(_mutex);
 
@@ -175,7 +222,7 @@ public:
     }
 
     for (size_t i = 0; i < kBinnedTrackerBinCount; i++) {
-      auto partial = _partial[i];
+      const auto &partial = _partial[i];
       for (size_t j = 0; j < partial.size(); j++) {
         MiniHeap *mh = partial[j];
         if (mh != nullptr)
@@ -222,7 +269,7 @@ public:
     }
 
     for (size_t i = 0; i < kBinnedTrackerBinCount; i++) {
-      auto partial = _partial[i];
+      const auto &partial = _partial[i];
       for (size_t j = 0; j < partial.size(); j++) {
         MiniHeap *mh = partial[j];
         if (mh != nullptr)
@@ -259,7 +306,7 @@ public:
     }
 
     for (size_t i = 0; i < kBinnedTrackerBinCount; i++) {
-      auto partial = _partial[i];
+      const auto &partial = _partial[i];
       for (size_t j = 0; j < partial.size(); j++) {
         MiniHeap *mh = partial[j];
         if (mh != nullptr)
@@ -287,7 +334,8 @@ public:
 
 private:
   // remove and return a MiniHeap uniformly at random from the given vector
-  MiniHeap *popRandomLocked(internal::vector<MiniHeap *> &vec) {
+  // with node >= 0, only miniheaps on that memory node are popped
+  MiniHeap *popRandomLocked(internal::vector<MiniHeap *> &vec, int node) {
     for (size_t i = 0; i < 16; i++) {
       const size_t off = _fastPrng.inRange(0, vec.size() - 1);
 
@@ -298,6 +346,9 @@ private:
       if (unlikely(mh->isAttached())) {
         continue;
       }
+      if (node >= 0 && mh->numaNode() != static_cast<uint32_t>(node)) {
+        continue;
+      }
 
       // when we pop for reuse, we effectively "top off" a MiniHeap, so
       // it moves into the full bin
@@ -63,13 +63,39 @@ static constexpr double kOccupancyCutoff = .8;
 static constexpr double kMeshesPerMap = .457;
 static constexpr size_t kDefaultMaxMeshCount = 30000;
 static constexpr size_t kMaxMeshesPerIteration = 2500;
+// mesh pairs whose syscalls are batched together; a fault on a span
+// being meshed waits for its whole batch
+static constexpr size_t kMeshBatchSize = 64;
+
+// how meshAllSizeClasses pairs up candidates (see method:: in
+// meshing.h); set at runtime with the mesh.method mallctl
+enum class MeshMethod : size_t {
+  ShiftedSplitting = 0,
+  Greedy = 1,
+  MultiWay = 2,
+};
+static constexpr size_t kMeshMethodCount = 3;
+static constexpr MeshMethod kDefaultMeshMethod = MeshMethod::ShiftedSplitting;
+// MeshMethod::MultiWay meshes groups of up to kMeshGroupSize spans at
+// once, formed around candidates below kMultiWayOccupancyCutoff
+static constexpr size_t kMeshGroupSize = 4;
+static constexpr size_t kMaxMeshGroupSize = 8;
+static constexpr double kMultiWayOccupancyCutoff = .25;
+// most threads (counting the caller) a mesh.compact pass runs on
+static constexpr size_t kMaxMeshWorkers = 8;
 
 // maximum number of dirty pages to hold onto before we flush them
 // back to the OS (via MeshableArena::scavenge()
 static constexpr size_t kMaxDirtyPageThreshold = 1 << 14;  // 64 MB in pages
 static constexpr size_t kMinDirtyPageThreshold = 32;       // 128 KB in pages
-
-static constexpr uint32_t kSpanClassCount = 256;
+// with a mesher thread, dirty pages are instead returned to the OS by
+// it once they have been free for mesh.dirty_decay_ms (0 turns this
+// off), checked kDirtyDecaySteps times per decay period
+static constexpr size_t kDefaultDirtyDecayMs = 1000;
+static constexpr uint32_t kDirtyDecaySteps = 10;
+// most hole punches in flight at once when they are issued through
+// io_uring (see PunchRing)
+static constexpr size_t kPunchRingDepth = 256;
 
 static constexpr int kNumBins = 25;  // 16Kb max object size
 static constexpr int kDefaultMeshPeriod = 10000;
@@ -80,22 +106,77 @@ static constexpr size_t kMinArenaExpansion = 4096;  // 16 MB in pages
 static constexpr uint64_t kMinStringLen = 8;
 static constexpr size_t kMiniheapRefillGoalSize = 4 * 1024;
 static constexpr size_t kMaxMiniheapsPerShuffleVector = 8;
+// partially free MiniHeaps parked per size class for reuse by other
+// threads, see transfer_cache.h
+static constexpr size_t kTransferCacheSize = 2 * kMaxMiniheapsPerShuffleVector;
 
 // shuffle vector features
 static constexpr int16_t kMaxShuffleVectorLength = 256;  // sizeof(uint8_t) << 8
 static constexpr bool kEnableShuffleOnInit = SHUFFLE_ON_INIT == 1;
 static constexpr bool kEnableShuffleOnFree = SHUFFLE_ON_FREE == 1;
 
+// share a heap between the threads running on each CPU, located with
+// the C library's rseq registration, rather than one heap per thread
+static constexpr bool kPerCPUHeaps = PER_CPU_HEAPS == 1;
+static constexpr size_t kMaxCPUHeaps = 256;
+// the arena keeps free pages, and each MiniHeap remembers its span's
+// memory node, for up to this many NUMA nodes (4 bits of
+// MiniHeap flags)
+static constexpr size_t kMaxNumaNodes = 8;
+// per-CPU heaps attach MiniHeaps with ids above any Linux tid
+// (PID_MAX_LIMIT is 2^22)
+static constexpr pid_t kCPUHeapIDBase = 0x40000000;
+// MiniHeaps in a transfer cache are attached to this (non-tid) id
+static constexpr pid_t kTransferCacheID = kCPUHeapIDBase - 1;
+
+// exiting threads park their heaps' MiniHeaps for new threads to
+// adopt (see ParkedHeapPool), attached to ids in
+// [kParkedHeapIDBase, kTransferCacheID)
+static constexpr size_t kMaxParkedHeaps = 16;
+static constexpr pid_t kParkedHeapIDBase = 0x20000000;
+static constexpr std::chrono::milliseconds kParkedHeapMaxAge{1000};  // 1 s
+
+// on Linux the arena is a memfd (falling back to an unlinked file in
+// /dev/shm or /tmp), sealed against being resized if this is set
+static constexpr bool kSealArenaFile = true;
+
 // madvise(DONTDUMP) the heap to make reasonable coredumps
 static constexpr bool kAdviseDump = false;
 
 static constexpr std::chrono::milliseconds kZeroMs{0};
 static constexpr std::chrono::milliseconds kMeshPeriodMs{100};  // 100 ms
+// periodic mesh passes are unbounded unless mesh.max_pause_us is set
+static constexpr size_t kDefaultMaxPauseUs = 0;
+// with a background mesher, wake it early once this many bytes have
+// been freed to detached miniheaps since its last pass
+static constexpr size_t kBackgroundMeshFreeTrigger = 16 * 1024 * 1024;  // 16 MB
+// adaptive mesh scheduling (mesh.adaptive): the time between passes
+// doubles after each unproductive pass, up to 2^kMaxMeshBackoff times
+// the base period, and halves, down to 2^-kMaxMeshSpeedup times it,
+// while passes are productive and memory is left to reclaim or the
+// heap is growing
+static constexpr size_t kDefaultMeshAdaptive = 1;
+static constexpr int kMaxMeshBackoff = 6;
+static constexpr int kMaxMeshSpeedup = 2;
+// a pass with at least this many meshes (~ 1 MB) was productive
+static constexpr size_t kMeshProductiveCount = 256;
+static constexpr size_t kMeshReclaimableTrigger = 8 * 1024 * 1024;  // 8 MB
 
 // controls aspects of miniheaps
 static constexpr size_t kMaxMeshes = 256;  // 1 per bit
 
+// the arena is reserved up front as kMaxArenaSegments segments of
+// address space, of which only the first is mapped to the arena file
+// to begin with: the rest are mapped as the arena grows into them.
 static constexpr size_t kArenaSize = 64ULL * 1024ULL * 1024ULL * 1024ULL;  // 64 GB
+static constexpr size_t kMaxArenaSegments = 16;
+static constexpr size_t kMaxArenaSize = kArenaSize * kMaxArenaSegments;  // 1 TB
+// the top of the first segment can be backed by (transparent) huge pages
+// instead of the arena file, see MeshableArena::enableHugePages.
+// Large allocations of at least a huge page are carved from it
+// huge-page aligned.
+static constexpr size_t kHugePageSize = 2 * 1024 * 1024;                  // 2 MB
+static constexpr size_t kHugePageArenaSize = kArenaSize / 4;              // 16 GB
 static constexpr size_t kAltStackSize = 16 * 1024UL;                       // 16k sigaltstacks
 #define SIGQUIESCE (SIGRTMIN + 7)
 #define SIGDUMP (SIGRTMIN + 8)
@@ -112,6 +193,15 @@ static inline constexpr size_t RoundUpToPage(size_t sz) {
   return kPageSize * PageCount(sz);
 }
 
+// large allocations of up to kMaxFastLargeSize are cached per thread
+// after being freed, binned by page count, see ThreadLocalHeap
+static constexpr size_t kLargeCacheMinPages = PageCount(kMaxSize) + 1;
+static constexpr size_t kLargeCacheMaxSpanPages = PageCount(kMaxFastLargeSize);
+static constexpr size_t kLargeCacheBinCount = kLargeCacheMaxSpanPages - kLargeCacheMinPages + 1;
+static constexpr size_t kLargeCacheBinDepth = 2;
+// bounds the memory held per thread -- 1 MB
+static constexpr size_t kLargeCacheMaxPages = 4 * kLargeCacheMaxSpanPages;
+
 namespace powerOfTwo {
 static constexpr size_t kMinObjectSize = 8;
 
@@ -0,0 +1,185 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__FREE_SPAN_MAP_H
+#define MESH__FREE_SPAN_MAP_H
+
+#include <cstdint>
+#include <utility>
+
+#include "internal.h"
+
+namespace mesh {
+
+// free spans of arena pages, coalesced with their neighbours as they
+// are added.  Spans are indexed both by offset, to find neighbours
+// and the pages following an allocation, and by (length, offset), so
+// that the best fit for an allocation -- the shortest span long
+// enough, lowest in the arena among those -- is found in O(log n).
+// Each span also carries the epoch it was last added in (the newest of
+// its parts', once coalesced), so that the spans which have sat unused
+// longest can be released first.  Not thread safe: the arena's lock protects it.
+class FreeSpanMap {
+private:
+  DISALLOW_COPY_AND_ASSIGN(FreeSpanMap);
+
+public:
+  FreeSpanMap() {
+  }
+
+  inline bool empty() const {
+    return _byOffset.empty();
+  }
+
+  // the number of (coalesced) spans
+  inline size_t size() const {
+    return _byOffset.size();
+  }
+
+  inline size_t pageCount() const {
+    return _pageCount;
+  }
+
+  // the later of two epochs, modulo 2^32
+  static inline uint32_t newerEpoch(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b) >= 0 ? a : b;
+  }
+
+  // add span, merging it with the free spans directly before and
+  // after it
+  void add(Span span, uint32_t epoch = 0) {
+    d_assert(!span.empty());
+
+    auto next = _byOffset.lower_bound(span.offset);
+    d_assert(next == _byOffset.end() || next->first >= span.offset + span.length);
+    _pageCount += span.length;
+
+    if (next != _byOffset.end() && next->first == span.offset + span.length) {
+      span.length += next->second.length;
+      epoch = newerEpoch(epoch, next->second.epoch);
+      _bySize.erase(std::make_pair(next->second.length, next->first));
+      next = _byOffset.erase(next);
+    }
+    if (next != _byOffset.begin()) {
+      auto prev = std::prev(next);
+      d_assert(prev->first + prev->second.length <= span.offset);
+      if (prev->first + prev->second.length == span.offset) {
+        _bySize.erase(std::make_pair(prev->second.length, prev->first));
+        span.offset = prev->first;
+        span.length += prev->second.length;
+        epoch = newerEpoch(epoch, prev->second.epoch);
+        _byOffset.erase(prev);
+      }
+    }
+
+    _byOffset.emplace_hint(next, span.offset, Entry{span.length, epoch});
+    _bySize.emplace(span.length, span.offset);
+  }
+
+  // remove the best fit for pageCount pages, returning its first
+  // pageCount pages in result; the rest stays free
+  bool takeBestFit(size_t pageCount, Span &result) {
+    d_assert(pageCount > 0);
+
+    auto fit = _bySize.lower_bound(std::make_pair(static_cast<Length>(pageCount), static_cast<Offset>(0)));
+    if (fit == _bySize.end()) {
+      return false;
+    }
+
+    Span span(fit->second, fit->first);
+    _bySize.erase(fit);
+    auto it = _byOffset.find(span.offset);
+    const auto epoch = it->second.epoch;
+    _byOffset.erase(it);
+    _pageCount -= span.length;
+
+    Span rest = span.splitAfter(pageCount);
+    if (!rest.empty()) {
+      // can't have a free neighbour: it would have been coalesced
+      _byOffset.emplace(rest.offset, Entry{rest.length, epoch});
+      _bySize.emplace(rest.length, rest.offset);
+      _pageCount += rest.length;
+    }
+
+    result = span;
+    return true;
+  }
+
+  // the length of the free span starting exactly at offset, or 0
+  inline size_t lengthAt(Offset offset) const {
+    auto it = _byOffset.find(offset);
+    return it == _byOffset.end() ? 0 : it->second.length;
+  }
+
+  // remove the pageCount pages starting exactly at offset, if they
+  // are all free
+  bool takeAt(Offset offset, size_t pageCount) {
+    auto it = _byOffset.find(offset);
+    if (it == _byOffset.end() || it->second.length < pageCount) {
+      return false;
+    }
+
+    Span span(it->first, it->second.length);
+    const auto epoch = it->second.epoch;
+    _bySize.erase(std::make_pair(span.length, span.offset));
+    _byOffset.erase(it);
+    _pageCount -= span.length;
+
+    Span rest = span.splitAfter(pageCount);
+    if (!rest.empty()) {
+      _byOffset.emplace(rest.offset, Entry{rest.length, epoch});
+      _bySize.emplace(rest.length, rest.offset);
+      _pageCount += rest.length;
+    }
+
+    return true;
+  }
+
+  // calls func on each span, in offset order
+  template <typename Func>
+  inline void forEach(const Func func) const {
+    for (const auto &entry : _byOffset) {
+      func(Span(entry.first, entry.second.length));
+    }
+  }
+
+  // remove each span last added at least minAge epochs before epoch,
+  // calling func on it.  Epochs are compared modulo 2^32, so they may
+  // wrap around.
+  template <typename Func>
+  inline void takeOlderThan(uint32_t epoch, uint32_t minAge, const Func func) {
+    for (auto it = _byOffset.begin(); it != _byOffset.end();) {
+      if (static_cast<uint32_t>(epoch - it->second.epoch) < minAge) {
+        ++it;
+        continue;
+      }
+      const Span span(it->first, it->second.length);
+      _bySize.erase(std::make_pair(span.length, span.offset));
+      it = _byOffset.erase(it);
+      _pageCount -= span.length;
+      func(span);
+    }
+  }
+
+  void clear() {
+    _byOffset.clear();
+    _bySize.clear();
+    _pageCount = 0;
+  }
+
+private:
+  struct Entry {
+    Length length;
+    uint32_t epoch;
+  };
+
+  internal::map<Offset, Entry> _byOffset{};
+  internal::set<std::pair<Length, Offset>> _bySize{};
+  size_t _pageCount{0};
+};
+}  // namespace mesh
+
+#endif  // MESH__FREE_SPAN_MAP_H
@@ -6,6 +6,7 @@
 #include "global_heap.h"
 
 #include "meshing.h"
+#include "real.h"
 #include "runtime.h"
 
 namespace mesh {
@@ -37,6 +38,62 @@ void *GlobalHeap::malloc(size_t sz) {
   return pageAlignedAlloc(1, pageCount);
 }
 
+void *GlobalHeap::calloc(size_t sz) {
+  d_assert(sz > kMaxSize);
+
+  bool isZeroed = false;
+  void *ptr = pageAlignedAlloc(1, PageCount(sz), &isZeroed);
+  if (!isZeroed) {
+    memset(ptr, 0, sz);
+  }
+
+  return ptr;
+}
+
+bool GlobalHeap::growInPlace(void *ptr, size_t newSize) {
+  lock_guard<mutex> lock(_arenaLock);
+
+  MiniHeap *oldMH = miniheapFor(ptr);
+  if (unlikely(oldMH == nullptr || oldMH->maxCount() != 1 || oldMH->isMeshed())) {
+    return false;
+  }
+  if (unlikely(reinterpret_cast<uintptr_t>(ptr) != oldMH->getSpanStart(arenaBegin()))) {
+    return false;
+  }
+
+  const auto oldSpan = oldMH->span();
+  const size_t pageCount = PageCount(newSize);
+  if (pageCount <= oldSpan.length) {
+    return true;
+  }
+
+  Span span = oldSpan;
+  if (!Super::extendInPlace(span, pageCount - oldSpan.length)) {
+    return false;
+  }
+  d_assert(span.length == pageCount);
+
+  // a MiniHeap's span and object size are fixed, so build a new one
+  // over the extended span and switch the page index over to it.
+  void *buf = _mhAllocator.alloc();
+  d_assert(buf != nullptr);
+  const auto miniheapID = MiniHeapID{_mhAllocator.offsetFor(buf)};
+  MiniHeap *mh = new (buf) MiniHeap(arenaBegin(), span, 1, pageCount * kPageSize);
+  if (oldMH->isHugePage()) {
+    mh->setHugePage();
+  }
+  mh->setNumaNode(oldMH->numaNode());
+  mh->mallocAt(arenaBegin(), 0);
+
+  Super::retrackMiniHeap(oldSpan, miniheapID);
+  Super::trackMiniHeap(Span(oldSpan.offset + oldSpan.length, span.length - oldSpan.length), miniheapID);
+
+  oldMH->MiniHeap::~MiniHeap();
+  _mhAllocator.free(oldMH);
+
+  return true;
+}
+
 void GlobalHeap::free(void *ptr) {
   auto mh = miniheapFor(ptr);
   if (unlikely(!mh)) {
@@ -59,56 +116,95 @@ void GlobalHeap::freeFor(MiniHeap *mh, void *ptr) {
     return;
   }
 
-  bool shouldConsiderMesh = 0;
-  {
-    lock_guard<mutex> lock(_miniheapLock);
-
-    // large objects are tracked with a miniheap per object and don't
-    // trigger meshing, because they are multiples of the page size.
-    // This can also include, for example, single page allocations w/
-    // 16KB alignment.
-    if (mh->maxCount() == 1) {
-      freeMiniheapLocked(mh, false);
-      return;
-    }
+  // large objects are tracked with a miniheap per object and don't
+  // trigger meshing, because they are multiples of the page size.
+  // This can also include, for example, single page allocations w/
+  // 16KB alignment.
+  if (mh->maxCount() == 1) {
+    lock_guard<mutex> lock(_arenaLock);
+    freeMiniheapLocked(mh, false);
+    return;
+  }
 
-    d_assert(mh->maxCount() > 1);
+  d_assert(mh->maxCount() > 1);
 
-    _lastMeshEffective.store(1, std::memory_order::memory_order_release);
-    mh->free(arenaBegin(), ptr);
+  // read before freeing: if we race with meshing, mh may be destroyed
+  // by the time we need to take its size class lock.
+  const auto sizeClass = mh->sizeClass();
 
-    if (unlikely(mh->isMeshed())) {
-      // our MiniHeap was meshed out from underneath us.  Grab the
-      // global lock to synchronize with a concurrent mesh, and
-      // re-update the bitmap
-      mh = miniheapFor(ptr);
-      hard_assert(!mh->isMeshed());
-      mh->free(arenaBegin(), ptr);
-    }
+  // avoid bouncing this cacheline between every freeing thread
+  if (unlikely(!_lastMeshEffective.load(std::memory_order_relaxed))) {
+    _lastMeshEffective.store(1, std::memory_order_release);
+  }
 
-    const auto remaining = mh->inUseCount();
-    shouldConsiderMesh = remaining > 0;
+  // the common case for a cross-thread free: clearing our bit in the
+  // MiniHeap's atomic bitmap is all that has to happen.
+  if (unlikely(!mh->tryFree(arenaBegin(), ptr))) {
+    // our MiniHeap was meshed out from underneath us.  Grab the
+    // size class lock to synchronize with the concurrent mesh, and
+    // re-update the bitmap of the new owner
+    freeForLocked(sizeClass, ptr);
+    return;
+  }
 
-    const auto sizeClass = mh->sizeClass();
+  const auto remaining = mh->inUseCount();
 
-    // this may free the miniheap -- we can't safely access it after
-    // this point.
-    bool shouldFlush = _littleheaps[sizeClass].postFree(mh, remaining);
-    mh = nullptr;
+  // attached MiniHeaps are re-binned when they are released by their
+  // thread, so only detached MiniHeaps whose occupancy crossed a bin
+  // boundary need the lock.
+  if (!mh->isAttached() && _littleheaps[sizeClass].needsRebin(mh, remaining)) {
+    lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+    rebinLocked(mh, ptr);
+  }
 
-    if (unlikely(shouldFlush)) {
-      flushBinLocked(sizeClass);
+  if (remaining > 0) {
+    maybeMesh(mh->objectSize());
+  }
+}
+
+void GlobalHeap::freeForLocked(int sizeClass, void *ptr) {
+  bool shouldConsiderMesh = false;
+  {
+    // meshing only happens between miniheaps of the same size class,
+    // so the owner of ptr is stable while we hold this lock.
+    lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+
+    auto mh = miniheapFor(ptr);
+    if (unlikely(!mh)) {
+      return;
     }
+    hard_assert(!mh->isMeshed());
+    d_assert(mh->sizeClass() == sizeClass);
+    mh->free(arenaBegin(), ptr);
+
+    shouldConsiderMesh = mh->inUseCount() > 0;
+    rebinLocked(mh, ptr);
   }
 
   if (shouldConsiderMesh) {
-    maybeMesh();
+    maybeMesh(SizeMap::ByteSizeForClass(sizeClass));
   }
 }
 
-int GlobalHeap::mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen) {
-  unique_lock<mutex> lock(_miniheapLock);
+void GlobalHeap::rebinLocked(MiniHeap *mh, void *ptr) {
+  // once our bitmap update is visible, another thread may free the
+  // last object in mh and flush it -- make sure ptr's page is still
+  // owned by mh before touching its bin.
+  if (unlikely(miniheapFor(ptr) != mh || mh->isMeshed())) {
+    return;
+  }
+
+  const auto sizeClass = mh->sizeClass();
 
+  // this may free the miniheap -- we can't safely access it after
+  // this point.
+  const bool shouldFlush = _littleheaps[sizeClass].postFree(mh, mh->inUseCount());
+  if (unlikely(shouldFlush)) {
+    flushBinLocked(sizeClass);
+  }
+}
+
+int GlobalHeap::mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen) {
   if (!oldp || !oldlenp || *oldlenp < sizeof(size_t))
     return -1;
 
@@ -121,15 +217,97 @@ int GlobalHeap::mallctl(const char *name, void *oldp, size_t *oldlenp, void *new
     auto newVal = reinterpret_cast<size_t *>(newp);
     _meshPeriod = *newVal;
     // resetNextMeshCheck();
+  } else if (strcmp(name, "mesh.method") == 0) {
+    *statp = _meshMethod;
+    if (!newp || newlen < sizeof(size_t))
+      return -1;
+    auto newVal = reinterpret_cast<size_t *>(newp);
+    if (*newVal >= kMeshMethodCount)
+      return -1;
+    _meshMethod = *newVal;
+  } else if (strcmp(name, "mesh.max_pause_us") == 0) {
+    *statp = _maxPauseUs;
+    if (!newp || newlen < sizeof(size_t))
+      return -1;
+    auto newVal = reinterpret_cast<size_t *>(newp);
+    _maxPauseUs = *newVal;
+  } else if (strcmp(name, "mesh.period_ms") == 0) {
+    *statp = _meshPeriodMs.count();
+    if (!newp || newlen < sizeof(size_t))
+      return -1;
+    auto newVal = reinterpret_cast<size_t *>(newp);
+    setMeshPeriodMs(std::chrono::milliseconds(*newVal));
+  } else if (strcmp(name, "mesh.adaptive") == 0) {
+    *statp = _meshAdaptive;
+    if (!newp || newlen < sizeof(size_t))
+      return -1;
+    auto newVal = reinterpret_cast<size_t *>(newp);
+    _meshAdaptive = *newVal != 0;
+    if (!_meshAdaptive) {
+      _meshIntervalMs = _meshPeriodMs.count();
+    }
+  } else if (strcmp(name, "mesh.interval_ms") == 0) {
+    // read-only: the adapted period
+    *statp = _meshIntervalMs;
+  } else if (strcmp(name, "mesh.reclaimable") == 0) {
+    // read-only: the estimate the adaptive schedule works from
+    size_t sz = 0;
+    for (size_t i = 0; i < kNumBins; i++) {
+      sz += _littleheaps[i].reclaimableBytes();
+    }
+    *statp = sz;
+  } else if (strcmp(name, "mesh.dirty_decay_ms") == 0) {
+    // how long the mesher thread lets freed pages stay dirty; 0 has
+    // them released inline once kMaxDirtyPageThreshold pile up
+    *statp = _dirtyDecayMs;
+    if (!newp || newlen < sizeof(size_t))
+      return -1;
+    auto newVal = reinterpret_cast<size_t *>(newp);
+    _dirtyDecayMs = *newVal;
+    if (_backgroundMeshing) {
+      {
+        lock_guard<mutex> lock(_arenaLock);
+        Super::setDirtyDecay(*newVal != 0);
+      }
+      // pick up the new period
+      _mesherCond.notify_one();
+    }
+  } else if (strcmp(name, "mesh.huge_pages") == 0) {
+    *statp = hugePagesEnabled();
+    if (!newp || newlen < sizeof(size_t))
+      return -1;
+    auto newVal = reinterpret_cast<size_t *>(newp);
+    if (*newVal && !enableHugePages(_hugePageClasses)) {
+      return -1;
+    }
+  } else if (strcmp(name, "mesh.hugepage_classes") == 0) {
+    // a bitmask of size classes to back with huge pages; setting it
+    // turns on the huge page region
+    *statp = _hugePageClasses;
+    if (!newp || newlen < sizeof(size_t))
+      return -1;
+    auto newVal = reinterpret_cast<size_t *>(newp);
+    if (!enableHugePages(*newVal)) {
+      return -1;
+    }
   } else if (strcmp(name, "mesh.scavenge") == 0) {
-    lock.unlock();
     scavenge(true);
-    lock.lock();
   } else if (strcmp(name, "mesh.compact") == 0) {
-    meshAllSizeClasses();
-    lock.unlock();
+    {
+      // an explicit compaction isn't time-bounded, and meshes size
+      // classes on several threads at once -- one per CPU, unless a
+      // thread count is passed in newp
+      const auto cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+      size_t workerCount = cpuCount > 0 ? static_cast<size_t>(cpuCount) : 1;
+      if (newp && newlen >= sizeof(size_t))
+        workerCount = max(*reinterpret_cast<size_t *>(newp), static_cast<size_t>(1));
+      workerCount = min(workerCount, kMaxMeshWorkers);
+      lock_guard<mutex> lock(_meshLock);
+      // try even if the last periodic pass found little to mesh
+      _lastMeshEffective = 1;
+      meshAllSizeClasses(0, workerCount);
+    }
     scavenge(true);
-    lock.lock();
   } else if (strcmp(name, "arena") == 0) {
     // not sure what this should do
   } else if (strcmp(name, "stats.resident") == 0) {
@@ -141,6 +319,7 @@ int GlobalHeap::mallctl(const char *name, void *oldp, size_t *oldlenp, void *new
     // all miniheaps at least partially full
     size_t sz = 0;
     for (size_t i = 0; i < kNumBins; i++) {
+      lock_guard<mutex> lock(_miniheapLocks[i]);
       const auto count = _littleheaps[i].nonEmptyCount();
       if (count == 0)
         continue;
@@ -152,6 +331,7 @@ int GlobalHeap::mallctl(const char *name, void *oldp, size_t *oldlenp, void *new
     // same as active for us, for now -- memory not returned to the OS
     size_t sz = 0;
     for (size_t i = 0; i < kNumBins; i++) {
+      lock_guard<mutex> lock(_miniheapLocks[i]);
       const auto &bin = _littleheaps[i];
       const auto count = bin.nonEmptyCount();
       if (count == 0)
@@ -164,106 +344,456 @@ int GlobalHeap::mallctl(const char *name, void *oldp, size_t *oldlenp, void *new
 }
 
 void GlobalHeap::meshLocked(MiniHeap *dst, MiniHeap *&src) {
-  const size_t dstSpanSize = dst->spanSize();
-  const auto dstSpanStart = reinterpret_cast<void *>(dst->getSpanStart(arenaBegin()));
+  internal::vector<std::pair<MiniHeap *, MiniHeap *>> batch{};
+  batch.emplace_back(dst, src);
+  meshBatchLocked(batch);
+}
 
-  src->forEachMeshed([&](const MiniHeap *mh) {
-    // marks srcSpans read-only
-    const auto srcSpan = reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()));
-    Super::beginMesh(dstSpanStart, srcSpan, dstSpanSize);
-    return false;
-  });
+void GlobalHeap::meshBatchLocked(internal::vector<std::pair<MiniHeap *, MiniHeap *>> &batch) {
+  internal::vector<MeshedSpan> spans{};
+  for (const auto &pair : batch) {
+    const auto dst = std::get<0>(pair);
+    const size_t dstSpanSize = dst->spanSize();
+    const auto dstSpanStart = reinterpret_cast<void *>(dst->getSpanStart(arenaBegin()));
+
+    std::get<1>(pair)->forEachMeshed([&](const MiniHeap *mh) {
+      const auto srcSpan = reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()));
+      spans.push_back(MeshedSpan{dstSpanStart, srcSpan, dstSpanSize});
+      return false;
+    });
+  }
+
+  // marks srcSpans read-only
+  Super::beginMeshes(spans);
 
   // does the copying of objects and updating of span metadata
-  dst->consume(arenaBegin(), src);
-  d_assert(src->isMeshed());
-
-  src->forEachMeshed([&](const MiniHeap *mh) {
-    d_assert(mh->isMeshed());
-    const auto srcSpan = reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()));
-    // frees physical memory + re-marks srcSpans as read/write
-    Super::finalizeMesh(dstSpanStart, srcSpan, dstSpanSize);
-    return false;
-  });
+  for (const auto &pair : batch) {
+    std::get<0>(pair)->consume(arenaBegin(), std::get<1>(pair));
+    d_assert(std::get<1>(pair)->isMeshed());
+  }
 
-  // make sure we adjust what bin the destination is in -- it might
-  // now be full and not a candidate for meshing
-  _littleheaps[dst->sizeClass()].postFree(dst, dst->inUseCount());
-  untrackMiniheapLocked(src);
+  // frees physical memory + re-marks srcSpans as read/write
+  Super::finalizeMeshes(spans);
+
+  for (const auto &pair : batch) {
+    const auto dst = std::get<0>(pair);
+    // make sure we adjust what bin the destination is in -- it might
+    // now be full and not a candidate for meshing
+    _littleheaps[dst->sizeClass()].postFree(dst, dst->inUseCount());
+    untrackMiniheapLocked(std::get<1>(pair));
+  }
 }
 
-void GlobalHeap::meshAllSizeClasses() {
-  Super::scavenge(false);
+void GlobalHeap::requestBackgroundMesh() {
+  {
+    lock_guard<mutex> lock(_mesherLock);
+    _meshRequested = true;
+  }
+  _mesherCond.notify_one();
+}
 
-  if (!_lastMeshEffective.load(std::memory_order::memory_order_acquire)) {
-    return;
+void GlobalHeap::requestBackgroundPurge() {
+  {
+    lock_guard<mutex> lock(_mesherLock);
+    _purgeRequested = true;
   }
+  _mesherCond.notify_one();
+}
 
-  if (Super::aboveMeshThreshold()) {
-    return;
+void GlobalHeap::backgroundMeshLoop() {
+  _backgroundMeshing = true;
+  {
+    // from now on freeing threads leave dirty pages to us
+    lock_guard<mutex> lock(_arenaLock);
+    Super::setDirtyDecay(dirtyDecayTick() != kZeroMs);
+  }
+  auto lastDecay = time::now();
+
+  while (true) {
+    const bool meshing = _meshPeriod != 0 && _meshPeriodMs != kZeroMs;
+    const auto decayTick = dirtyDecayTick();
+    bool meshRequested = false;
+    bool purgeRequested = false;
+    {
+      unique_lock<mutex> lock(_mesherLock);
+      const auto woken = [&] { return _meshRequested || _purgeRequested; };
+      if (!meshing && decayTick == kZeroMs) {
+        _mesherCond.wait(lock, woken);
+      } else if (!meshing) {
+        _mesherCond.wait_for(lock, decayTick, woken);
+      } else if (decayTick == kZeroMs) {
+        _mesherCond.wait_for(lock, meshInterval(), woken);
+      } else {
+        _mesherCond.wait_for(lock, std::min(meshInterval(), decayTick), woken);
+      }
+      meshRequested = _meshRequested;
+      purgeRequested = _purgeRequested;
+      _meshRequested = false;
+      _purgeRequested = false;
+    }
+
+    const auto now = time::now();
+    if (decayTick != kZeroMs && (purgeRequested || now - lastDecay >= decayTick)) {
+      lastDecay = now;
+      lock_guard<mutex> lock(_arenaLock);
+      Super::decayScavenge();
+    }
+
+    if (!meshing) {
+      _freedSinceMesh.store(0, std::memory_order_relaxed);
+      continue;
+    }
+    // woken up only to decay
+    if (!meshRequested && now - _lastMesh < meshInterval()) {
+      continue;
+    }
+
+    _freedSinceMesh.store(0, std::memory_order_relaxed);
+    lock_guard<mutex> lock(_meshLock);
+    _lastMesh = time::now();
+    meshAllSizeClasses(_maxPauseUs);
   }
+}
 
-  _lastMeshEffective = 1;
+bool GlobalHeap::isLiveCandidateLocked(const MiniHeap *mh, int sizeClass) const {
+  if (mh->sizeClass() != sizeClass || mh->isMeshed() || !mh->isMeshingCandidate()) {
+    return false;
+  }
 
-  // const auto start = time::now();
-  size_t partialCount = 0;
+  // mh may have been freed (and its memory reused) since it was
+  // picked as a candidate; a live miniheap owns its span in the index
+  return miniheapFor(reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()))) == mh;
+}
 
-  internal::vector<std::pair<MiniHeap *, MiniHeap *>> mergeSets;
+bool GlobalHeap::stillMeshableLocked(MiniHeap *dst, MiniHeap *src, int sizeClass) const {
+  if (!isLiveCandidateLocked(dst, sizeClass) || !isLiveCandidateLocked(src, sizeClass)) {
+    return false;
+  }
 
-  // first, clear out any free memory we might have
-  for (size_t i = 0; i < kNumBins; i++) {
-    flushBinLocked(i);
+  if (dst->meshCount() + src->meshCount() > kMaxMeshes) {
+    return false;
+  }
+
+  // meshing must never leave objects on remote memory
+  if (dst->numaNode() != src->numaNode()) {
+    return false;
   }
 
+  return mesh::bitmapsMeshable(dst->bitmap().bits(), src->bitmap().bits(), dst->bitmap().byteCount());
+}
+
+bool GlobalHeap::meshSizeClass(size_t sizeClass, MWC &prng, MeshMethod meshMethod,
+                               const function<bool()> &overBudget, size_t &meshCount) {
+  auto &scratch = _meshScratch[sizeClass];
+  auto &mergeSets = scratch.pairs;
+  mergeSets.clear();
+
   auto meshFound =
       function<void(std::pair<MiniHeap *, MiniHeap *> &&)>([&](std::pair<MiniHeap *, MiniHeap *> &&miniheaps) {
         if (std::get<0>(miniheaps)->isMeshingCandidate() && std::get<0>(miniheaps)->isMeshingCandidate())
           mergeSets.push_back(std::move(miniheaps));
       });
 
-  for (size_t i = 0; i < kNumBins; i++) {
-    partialCount += _littleheaps[i].partialSize();
-    method::shiftedSplitting(_fastPrng, _littleheaps[i], meshFound);
+  auto &candidates = scratch.candidates;
+  {
+    lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+
+    // make cached miniheaps candidates, then clear out any free
+    // memory we might have
+    drainTransferCacheLocked(sizeClass);
+    flushBinLocked(sizeClass);
+
+    _littleheaps[sizeClass].meshingCandidates(kOccupancyCutoff, candidates);
+  }
+
+  // pairing candidates up only reads their bitmaps, so we do it
+  // without holding the size class lock; by the time we take it
+  // again a pair may no longer be meshable, so each is re-checked
+  auto findMeshes = [&](internal::vector<MiniHeap *> &nodeCandidates) {
+    switch (meshMethod) {
+    case MeshMethod::Greedy:
+      method::GreedyMatching::findMeshes(prng, nodeCandidates, scratch, meshFound);
+      break;
+    case MeshMethod::MultiWay:
+      method::MultiWayMatching::findMeshes(prng, nodeCandidates, scratch, meshFound);
+      break;
+    case MeshMethod::ShiftedSplitting:
+    default:
+      method::ShiftedSplitting::findMeshes(prng, nodeCandidates, scratch, meshFound);
+      break;
+    }
+  };
+  if (numa::nodeCount() == 1) {
+    findMeshes(candidates);
+  } else {
+    // only spans on the same node are paired up
+    auto &nodeCandidates = scratch.nodeCandidates;
+    for (uint32_t node = 0; node < numa::nodeCount(); node++) {
+      nodeCandidates.clear();
+      for (auto mh : candidates) {
+        if (mh->numaNode() == node) {
+          nodeCandidates.push_back(mh);
+        }
+      }
+      findMeshes(nodeCandidates);
+    }
   }
+  if (mergeSets.empty()) {
+    return true;
+  }
+
+  lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+  auto &batch = scratch.batch;
+
+  // consecutive pairs with the same first miniheap are a group (see
+  // method::multiWayMatching), all meshed into one destination: each
+  // member has to be disjoint from everything already in the group,
+  // not just from the destination as it is now
+  MiniHeap *groupKey = nullptr;
+  MiniHeap *groupDst = nullptr;
+  size_t groupMeshCount = 0;
+  PackedBitmap groupBits;
+  PackedBitmap srcBits;
+
+  for (size_t i = 0; i < mergeSets.size();) {
+    // pairs are meshed in batches, sharing syscalls, with the arena
+    // lock held per batch (rather than for the whole pass) to keep
+    // large allocations and frees from stalling.  A group is never
+    // split across batches.
+    lock_guard<mutex> arenaLock(_arenaLock);
+    batch.clear();
+    for (; i < mergeSets.size() && (batch.size() < kMeshBatchSize || std::get<0>(mergeSets[i]) == groupKey); i++) {
+      auto &mergeSet = mergeSets[i];
+
+      if (groupDst != nullptr && std::get<0>(mergeSet) == groupKey) {
+        const auto src = std::get<1>(mergeSet);
+        if (!isLiveCandidateLocked(src, sizeClass) || groupMeshCount + src->meshCount() > kMaxMeshes ||
+            src->numaNode() != groupDst->numaNode()) {
+          continue;
+        }
+        srcBits.copyFrom(src->bitmap().bits());
+        if (!groupBits.disjointWith(srcBits)) {
+          continue;
+        }
+        groupBits.orWith(srcBits);
+        groupMeshCount += src->meshCount();
+        batch.emplace_back(groupDst, src);
+        continue;
+      }
+
+      groupKey = std::get<0>(mergeSet);
+      groupDst = nullptr;
+
+      // merge _into_ the one with a larger mesh count, potentially
+      // swapping the order of the pair
+      const auto aCount = std::get<0>(mergeSet)->meshCount();
+      const auto bCount = std::get<1>(mergeSet)->meshCount();
+      if (aCount + bCount > kMaxMeshes) {
+        continue;
+      } else if (aCount < bCount) {
+        mergeSet = std::pair<MiniHeap *, MiniHeap *>(std::get<1>(mergeSet), std::get<0>(mergeSet));
+      }
 
-  // we consider this effective if more than ~ 1 MB saved
-  _lastMeshEffective = mergeSets.size() > 256;
+      if (!stillMeshableLocked(std::get<0>(mergeSet), std::get<1>(mergeSet), sizeClass)) {
+        continue;
+      }
+      batch.push_back(mergeSet);
+
+      groupDst = std::get<0>(mergeSet);
+      groupMeshCount = aCount + bCount;
+      groupBits.copyFrom(groupDst->bitmap().bits());
+      srcBits.copyFrom(std::get<1>(mergeSet)->bitmap().bits());
+      groupBits.orWith(srcBits);
+    }
+
+    if (batch.empty()) {
+      continue;
+    }
+    meshBatchLocked(batch);
+    meshCount += batch.size();
+
+    // the pairs left over are found again next pass
+    if (overBudget()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void *GlobalHeap::parallelMeshWorker(void *arg) {
+  auto pass = reinterpret_cast<ParallelMeshPass *>(arg);
+  pass->heap->meshSizeClassesFrom(*pass);
+  return nullptr;
+}
 
-  if (mergeSets.size() == 0) {
+void GlobalHeap::meshSizeClassesFrom(ParallelMeshPass &pass) {
+  MWC prng(internal::seed(), internal::seed());
+  auto unbounded = function<bool()>([]() { return false; });
+
+  size_t meshCount = 0;
+  for (size_t i = pass.nextClass++; i < kNumBins; i = pass.nextClass++) {
+    meshSizeClass(i, prng, pass.meshMethod, unbounded, meshCount);
+  }
+  pass.meshCount += meshCount;
+}
+
+size_t GlobalHeap::meshSizeClassesParallel(MeshMethod meshMethod, size_t workerCount) {
+  ParallelMeshPass pass{};
+  pass.heap = this;
+  pass.meshMethod = meshMethod;
+
+  if (unlikely(mesh::real::pthread_create == nullptr)) {
+    mesh::real::init();
+  }
+
+  // the workers only use the internal heap, so they skip
+  // Runtime::createThread's per-thread setup
+  pthread_t workers[kMaxMeshWorkers];
+  size_t started = 0;
+  for (size_t i = 1; i < workerCount && started < kMaxMeshWorkers; i++) {
+    if (mesh::real::pthread_create(&workers[started], nullptr, parallelMeshWorker, &pass) != 0) {
+      break;
+    }
+    started++;
+  }
+
+  // this thread works through size classes too, so a failure to
+  // create workers just makes the pass slower
+  meshSizeClassesFrom(pass);
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(workers[i], nullptr);
+  }
+
+  return pass.meshCount;
+}
+
+void GlobalHeap::meshAllSizeClasses(size_t maxPauseUs, size_t workerCount) {
+  // MiniHeaps parked for too long are released first, so they can be
+  // meshed below
+  releaseParkedHeaps(time::now() - kParkedHeapMaxAge);
+
+  {
+    lock_guard<mutex> lock(_arenaLock);
     Super::scavenge(false);
-    // debug("nothing to mesh.");
+  }
+
+  if (!_lastMeshEffective.load(std::memory_order::memory_order_acquire)) {
+    updateMeshSchedule(false);
     return;
   }
 
-  _stats.meshCount += mergeSets.size();
+  {
+    lock_guard<mutex> lock(_arenaLock);
+    if (Super::aboveMeshThreshold()) {
+      return;
+    }
+  }
 
-  for (auto &mergeSet : mergeSets) {
-    // merge _into_ the one with a larger mesh count, potentially
-    // swapping the order of the pair
-    const auto aCount = std::get<0>(mergeSet)->meshCount();
-    const auto bCount = std::get<1>(mergeSet)->meshCount();
-    if (aCount + bCount > kMaxMeshes) {
-      continue;
-    } else if (aCount < bCount) {
-      mergeSet = std::pair<MiniHeap *, MiniHeap *>(std::get<1>(mergeSet), std::get<0>(mergeSet));
+  _lastMeshEffective = 1;
+
+  size_t meshCount = 0;
+  bool finished = true;
+
+  const auto meshMethod = static_cast<MeshMethod>(_meshMethod.load(std::memory_order_relaxed));
+
+  if (workerCount > 1) {
+    d_assert(maxPauseUs == 0);
+    meshCount = meshSizeClassesParallel(meshMethod, workerCount);
+    _meshResumeClass = 0;
+  } else {
+    // time::now() is too coarse to measure a pause budget with
+    const auto start = std::chrono::steady_clock::now();
+    const auto budget = std::chrono::microseconds(maxPauseUs);
+    auto overBudget = function<bool()>(
+        [&]() { return maxPauseUs > 0 && std::chrono::steady_clock::now() - start >= budget; });
+
+    // size classes are meshed one at a time, so allocation and frees
+    // in every other size class proceed while we work.  A pass that
+    // runs out of budget stops at a size class boundary or after a
+    // pair, and the next one starts with the size class it stopped in.
+    const size_t firstClass = _meshResumeClass;
+    for (size_t n = 0; n < kNumBins; n++) {
+      const size_t i = (firstClass + n) % kNumBins;
+      if ((n > 0 && overBudget()) || !meshSizeClass(i, _meshPrng, meshMethod, overBudget, meshCount)) {
+        _meshResumeClass = i;
+        finished = false;
+        break;
+      }
     }
 
-    meshLocked(std::get<0>(mergeSet), std::get<1>(mergeSet));
+    if (finished) {
+      _meshResumeClass = 0;
+    }
+  }
+
+  // we consider this effective if more than ~ 1 MB saved; an
+  // unfinished pass always is, so the next one resumes it
+  const bool productive = !finished || meshCount >= kMeshProductiveCount;
+  _lastMeshEffective = productive;
+  updateMeshSchedule(productive);
+
+  {
+    lock_guard<mutex> lock(_arenaLock);
+    Super::scavenge(false);
+  }
+
+  if (meshCount == 0) {
+    // debug("nothing to mesh.");
+    return;
   }
 
-  Super::scavenge(false);
+  _stats.meshCount += meshCount;
 
   _lastMesh = time::now();
 
   // const std::chrono::duration<double> duration = _lastMesh - start;
-  // debug("mesh took %f, found %zu", duration.count(), mergeSets.size());
+  // debug("mesh took %f, found %zu", duration.count(), meshCount);
+}
+
+void GlobalHeap::updateMeshSchedule(bool productive) {
+  const size_t base = _meshPeriodMs.count();
+  if (!_meshAdaptive.load(std::memory_order_relaxed)) {
+    _meshBackoff = 0;
+    _meshIntervalMs = base;
+    return;
+  }
+
+  size_t reclaimable = 0;
+  size_t footprint = 0;
+  for (size_t i = 0; i < kNumBins; i++) {
+    reclaimable += _littleheaps[i].reclaimableBytes();
+    footprint += _littleheaps[i].nonEmptyBytes();
+  }
+
+  // the heap grew by more than an eighth since the last pass
+  const bool growing = footprint > _lastFootprint + _lastFootprint / 8 + kPageSize;
+  _lastFootprint = footprint;
+  const bool pressure = growing || reclaimable >= kMeshReclaimableTrigger;
+
+  // if passes stop finding anything, even when there seems to be
+  // plenty to reclaim, there is no point in looking as often
+  if (productive && pressure) {
+    _meshBackoff = max(_meshBackoff - 1, -kMaxMeshSpeedup);
+  } else if (productive || pressure) {
+    _meshBackoff = min(_meshBackoff, 0);
+  } else {
+    _meshBackoff = min(_meshBackoff + 1, kMaxMeshBackoff);
+  }
+
+  if (_meshBackoff >= 0) {
+    _meshIntervalMs = base << _meshBackoff;
+  } else {
+    _meshIntervalMs = max(base >> -_meshBackoff, static_cast<size_t>(1));
+  }
 }
 
 void GlobalHeap::dumpStats(int level, bool beDetailed) const {
   if (level < 1)
     return;
 
-  lock_guard<mutex> lock(_miniheapLock);
+  lock_guard<mutex> lock(_arenaLock);
 
   const auto meshedPageHWM = meshedPageHighWaterMark();
 
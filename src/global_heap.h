@@ -13,7 +13,10 @@
 #include "binned_tracker.h"
 #include "internal.h"
 #include "meshable_arena.h"
+#include "meshing.h"
 #include "mini_heap.h"
+#include "parked_heap_pool.h"
+#include "transfer_cache.h"
 
 #include "heaplayers.h"
 
@@ -29,6 +32,12 @@ public:
   size_t mhHighWaterMark;
 };
 
+// padded so that contended size-class locks don't share cachelines
+class CACHELINE_ALIGNED CachelineAlignedMutex : public mutex {};
+
+// Locking: _meshLock is acquired first, then any per-size-class
+// locks in increasing size-class order, then _arenaLock.  Each
+// BinnedTracker's own mutex is innermost.
 class GlobalHeap : public MeshableArena {
 private:
   DISALLOW_COPY_AND_ASSIGN(GlobalHeap);
@@ -49,45 +58,76 @@ public:
   }
 
   inline void dumpStrings() const {
-    lock_guard<mutex> lock(_miniheapLock);
-
     for (size_t i = 0; i < kNumBins; i++) {
+      lock_guard<mutex> lock(_miniheapLocks[i]);
       _littleheaps[i].printOccupancy();
     }
   }
 
   inline void flushAllBins() {
+    releaseParkedHeaps(time::time_point::max());
     for (size_t sizeClass = 0; sizeClass < kNumBins; sizeClass++) {
+      lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+      drainTransferCacheLocked(sizeClass);
       flushBinLocked(sizeClass);
     }
   }
 
   void scavenge(bool force = false) {
-    lock_guard<mutex> lock(_miniheapLock);
+    lock_guard<mutex> lock(_arenaLock);
 
     Super::scavenge(force);
   }
 
+  void disableAsyncPunching() {
+    lock_guard<mutex> lock(_arenaLock);
+
+    Super::disableAsyncPunching();
+  }
+
   void dumpStats(int level, bool beDetailed) const;
 
-  // must be called with exclusive _mhRWLock held
+  // must be called with _arenaLock held, and for small miniheaps
+  // (sizeClass >= 0) the size class's lock as well.  If isZeroed is
+  // non-null, it is set to whether the new span's memory is known to
+  // be all zeros.
   inline MiniHeap *ATTRIBUTE_ALWAYS_INLINE allocMiniheapLocked(int sizeClass, size_t pageCount, size_t objectCount,
-                                                               size_t objectSize, size_t pageAlignment = 1) {
+                                                               size_t objectSize, size_t pageAlignment = 1,
+                                                               bool *isZeroed = nullptr) {
     d_assert(0 < pageCount);
 
     void *buf = _mhAllocator.alloc();
     d_assert(buf != nullptr);
 
+    // large allocations of at least a huge page, and the size
+    // classes asked for, come from the huge page region if it is on
+    bool hugePages = false;
+    if (Super::hugePagesEnabled()) {
+      hugePages = sizeClass < 0 ? pageCount * kPageSize >= kHugePageSize
+                                : (_hugePageClasses.load(std::memory_order_relaxed) >> sizeClass) & 1;
+    }
+
     // allocate out of the arena
     Span span{0, 0};
-    char *spanBegin = Super::pageAlloc(span, pageCount, pageAlignment);
+    internal::PageType type(internal::PageType::Unknown);
+    char *spanBegin = Super::pageAlloc(span, pageCount, pageAlignment, type, hugePages);
     d_assert(spanBegin != nullptr);
+    if (isZeroed != nullptr) {
+      *isZeroed = type == internal::PageType::Clean;
+    }
     d_assert((reinterpret_cast<uintptr_t>(spanBegin) / kPageSize) % pageAlignment == 0);
 
     const auto miniheapID = MiniHeapID{_mhAllocator.offsetFor(buf)};
     Super::trackMiniHeap(span, miniheapID);
 
     MiniHeap *mh = new (buf) MiniHeap(arenaBegin(), span, objectCount, objectSize);
+    if (Super::inHugePageArena(span.offset)) {
+      // placed on first touch, normally by the thread allocating it
+      mh->setHugePage();
+      mh->setNumaNode(numa::currentNode());
+    } else {
+      mh->setNumaNode(Super::nodeForOffset(span.offset));
+    }
 
     if (sizeClass >= 0) {
       trackMiniheapLocked(mh);
@@ -100,10 +140,10 @@ public:
     return mh;
   }
 
-  inline void *pageAlignedAlloc(size_t pageAlignment, size_t pageCount) {
-    lock_guard<mutex> lock(_miniheapLock);
+  inline void *pageAlignedAlloc(size_t pageAlignment, size_t pageCount, bool *isZeroed = nullptr) {
+    lock_guard<mutex> lock(_arenaLock);
 
-    MiniHeap *mh = allocMiniheapLocked(-1, pageCount, 1, pageCount * kPageSize, pageAlignment);
+    MiniHeap *mh = allocMiniheapLocked(-1, pageCount, 1, pageCount * kPageSize, pageAlignment, isZeroed);
 
     d_assert(mh->maxCount() == 1);
     d_assert(mh->spanSize() == pageCount * kPageSize);
@@ -114,21 +154,67 @@ public:
     return ptr;
   }
 
-  inline void releaseMiniheapLocked(MiniHeap *mh, int sizeClass) {
-    // ensure this flag is always set with the miniheap lock held
+  // detach mh from its thread-local heap.  Attached miniheaps live in
+  // their tracker's full bin, so re-binning here only needs the
+  // BinnedTracker's own mutex (and not even that if mh is still full).
+  inline void detachMiniheap(MiniHeap *mh, int sizeClass) {
     mh->unsetAttached();
     _littleheaps[sizeClass].postFree(mh, mh->inUseCount());
   }
 
+  // give mh up from a thread-local heap: park it in the size class's
+  // transfer cache if another thread could allocate from it,
+  // otherwise detach it.
+  inline void releaseMiniheap(MiniHeap *mh, int sizeClass) {
+    if (!mh->isFull()) {
+      mh->setAttached(kTransferCacheID);
+      if (_transferCaches[sizeClass].put(mh)) {
+        return;
+      }
+    }
+
+    detachMiniheap(mh, sizeClass);
+  }
+
+  // called with the size class lock held, so that e.g. meshing sees
+  // every partially full miniheap
+  inline void drainTransferCacheLocked(size_t sizeClass) {
+    while (MiniHeap *mh = _transferCaches[sizeClass].take()) {
+      detachMiniheap(mh, sizeClass);
+    }
+  }
+
+  // hand the MiniHeaps of an exiting thread's heap to the next new
+  // thread.  Returns false if there is no room to park them.
+  inline bool parkMiniheaps(ParkedHeapPool::MiniHeapArray *miniheaps[kNumBins]) {
+    releaseParkedHeaps(time::now() - kParkedHeapMaxAge);
+    return _parkedHeaps.park(miniheaps, [&](MiniHeap *mh) { releaseMiniheap(mh, mh->sizeClass()); });
+  }
+
+  // take over the MiniHeaps of a parked heap, returning the id they
+  // are attached to (or 0 if nothing was parked)
+  inline pid_t adoptMiniheaps(ParkedHeapPool::MiniHeapArray *miniheaps[kNumBins]) {
+    return _parkedHeaps.adopt(miniheaps);
+  }
+
+  // release heaps parked before cutoff, so that their MiniHeaps can
+  // be reused by other threads and meshed
+  inline void releaseParkedHeaps(time::time_point cutoff) {
+    _parkedHeaps.releaseParkedBefore(cutoff, [&](MiniHeap *mh) { releaseMiniheap(mh, mh->sizeClass()); });
+  }
+
   template <uint32_t Size>
   inline void releaseMiniheaps(FixedArray<MiniHeap, Size> &miniheaps) {
     if (miniheaps.size() == 0) {
       return;
     }
 
-    lock_guard<mutex> lock(_miniheapLock);
+    // a shuffle vector's miniheaps all belong to a single size class
+    const auto sizeClass = miniheaps[0]->sizeClass();
+
     for (auto mh : miniheaps) {
-      releaseMiniheapLocked(mh, mh->sizeClass());
+      d_assert(mh->sizeClass() == sizeClass);
+      releaseMiniheap(mh, sizeClass);
     }
     miniheaps.clear();
   }
@@ -136,15 +222,36 @@ public:
   template <uint32_t Size>
   inline void allocSmallMiniheaps(int sizeClass, uint32_t objectSize, FixedArray<MiniHeap, Size> &miniheaps,
                                   pid_t current) {
-    lock_guard<mutex> lock(_miniheapLock);
-
     d_assert(sizeClass >= 0);
+    d_assert(sizeClass < kNumBins);
 
     for (MiniHeap *oldMH : miniheaps) {
-      releaseMiniheapLocked(oldMH, sizeClass);
+      releaseMiniheap(oldMH, sizeClass);
     }
     miniheaps.clear();
 
+    // miniheaps on the caller's memory node are preferred throughout
+    const int node = numa::nodeCount() > 1 ? numa::currentNode() : -1;
+
+    // first try to refill from miniheaps other threads gave up,
+    // without taking the size class lock
+    size_t bytesFree = 0;
+    while (bytesFree < kMiniheapRefillGoalSize && !miniheaps.full()) {
+      MiniHeap *mh = _transferCaches[sizeClass].take(node);
+      if (mh == nullptr) {
+        break;
+      }
+      d_assert(mh->current() == kTransferCacheID);
+      mh->setAttached(current);
+      miniheaps.append(mh);
+      bytesFree += mh->bytesFree();
+    }
+    if (bytesFree >= kMiniheapRefillGoalSize || miniheaps.full()) {
+      return;
+    }
+
+    lock_guard<mutex> lock(_miniheapLocks[sizeClass]);
+
     d_assert(objectSize <= _maxObjectSize);
 
 #ifndef NDEBUG
@@ -156,13 +263,19 @@ public:
     d_assert(sizeClass >= 0);
     d_assert(sizeClass < kNumBins);
 
-    d_assert(miniheaps.size() == 0);
-
     // check our bins for a miniheap to reuse
-    auto bytesFree = _littleheaps[sizeClass].selectForReuse(miniheaps, current);
+    bytesFree += _littleheaps[sizeClass].selectForReuse(miniheaps, current, node);
     if (bytesFree >= kMiniheapRefillGoalSize || miniheaps.full()) {
       return;
     }
+    // remote memory before growing the heap, but only if nothing local
+    // was found
+    if (node >= 0 && miniheaps.size() == 0) {
+      bytesFree += _littleheaps[sizeClass].selectForReuse(miniheaps, current);
+      if (bytesFree >= kMiniheapRefillGoalSize || miniheaps.full()) {
+        return;
+      }
+    }
 
     // if we have objects bigger than the size of a page, allocate
     // multiple pages to amortize the cost of creating a
@@ -171,6 +284,7 @@ public:
     const size_t objectCount = max(kPageSize / objectSize, kMinStringLen);
     const size_t pageCount = PageCount(objectSize * objectCount);
 
+    lock_guard<mutex> arenaLock(_arenaLock);
     while (bytesFree < kMiniheapRefillGoalSize && !miniheaps.full()) {
       auto mh = allocMiniheapLocked(sizeClass, pageCount, objectCount, objectSize);
       d_assert(!mh->isAttached());
@@ -185,11 +299,25 @@ public:
   // large, page-multiple allocations
   void *ATTRIBUTE_NEVER_INLINE malloc(size_t sz);
 
+  // large, zeroed allocations.  Spans carved out of clean pages are
+  // already zero, so we only memset (and fault in) reused dirty pages.
+  void *ATTRIBUTE_NEVER_INLINE calloc(size_t sz);
+
+  // try to grow the large allocation at ptr to at least newSize bytes
+  // without moving it
+  bool ATTRIBUTE_NEVER_INLINE growInPlace(void *ptr, size_t newSize);
+
   inline MiniHeap *ATTRIBUTE_ALWAYS_INLINE miniheapFor(const void *ptr) const {
     auto mh = reinterpret_cast<MiniHeap *>(Super::lookupMiniheap(ptr));
     return mh;
   }
 
+  // for a thread's frees: mostly they hit the page map leaf its last
+  // lookup went through
+  inline MiniHeap *ATTRIBUTE_ALWAYS_INLINE miniheapFor(const void *ptr, PageMap::Cache &cache) const {
+    return reinterpret_cast<MiniHeap *>(Super::lookupMiniheap(ptr, cache));
+  }
+
   inline MiniHeap *ATTRIBUTE_ALWAYS_INLINE miniheapForID(const MiniHeapID id) const {
     auto mh = reinterpret_cast<MiniHeap *>(_mhAllocator.ptrFromOffset(id.value()));
     __builtin_prefetch(mh, 1, 2);
@@ -209,9 +337,10 @@ public:
     _littleheaps[mh->sizeClass()].remove(mh);
   }
 
+  // lock-free in the common case, see the comments in global_heap.cc
   void freeFor(MiniHeap *mh, void *ptr);
 
-  // called with lock held
+  // called with _arenaLock held
   void freeMiniheapAfterMeshLocked(MiniHeap *mh, bool untrack = true) {
     // don't untrack a meshed miniheap -- it has already been untracked
     if (untrack && !mh->isMeshed()) {
@@ -225,10 +354,12 @@ public:
   }
 
   void freeMiniheap(MiniHeap *&mh, bool untrack = true) {
-    lock_guard<mutex> lock(_miniheapLock);
+    lock_guard<mutex> lock(_miniheapLocks[mh->sizeClass()]);
+    lock_guard<mutex> arenaLock(_arenaLock);
     freeMiniheapLocked(mh, untrack);
   }
 
+  // called with _arenaLock held (and the size class lock, if untrack)
   void freeMiniheapLocked(MiniHeap *&mh, bool untrack) {
     const auto spanSize = mh->spanSize();
     MiniHeap *toFree[kMaxMeshes];
@@ -242,6 +373,7 @@ public:
       return false;
     });
 
+    const bool purgeRequested = Super::purgeRequested();
     for (size_t i = 0; i < last; i++) {
       MiniHeap *mh = toFree[i];
       const bool isMeshed = mh->isMeshed();
@@ -251,11 +383,22 @@ public:
       freeMiniheapAfterMeshLocked(mh, untrack);
     }
 
+    // too many dirty pages piled up between decay passes
+    if (unlikely(!purgeRequested && Super::purgeRequested())) {
+      requestBackgroundPurge();
+    }
+
     mh = nullptr;
   }
 
+  // called with the size class lock held
   inline void flushBinLocked(size_t sizeClass) {
     auto emptyMiniheaps = _littleheaps[sizeClass].getFreeMiniheaps();
+    if (emptyMiniheaps.size() == 0) {
+      return;
+    }
+
+    lock_guard<mutex> arenaLock(_arenaLock);
     for (size_t i = 0; i < emptyMiniheaps.size(); i++) {
       freeMiniheapLocked(emptyMiniheaps[i], false);
     }
@@ -267,7 +410,7 @@ public:
     if (unlikely(ptr == nullptr))
       return 0;
 
-    lock_guard<mutex> lock(_miniheapLock);
+    lock_guard<mutex> lock(_arenaLock);
     auto mh = miniheapFor(ptr);
     if (likely(mh)) {
       return mh->objectSize();
@@ -279,29 +422,71 @@ public:
   int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
 
   size_t getAllocatedMiniheapCount() const {
-    lock_guard<mutex> lock(_miniheapLock);
+    lock_guard<mutex> lock(_arenaLock);
     return _miniheapCount;
   }
 
+  // back large allocations, and new miniheaps of the size classes set
+  // in classes, with huge pages.  Returns false if the arena has
+  // already grown too large to set aside its huge page region.
+  bool enableHugePages(uint32_t classes = 0) {
+    lock_guard<mutex> lock(_arenaLock);
+    if (!Super::enableHugePages()) {
+      return false;
+    }
+    _hugePageClasses = classes & ((1U << kNumBins) - 1);
+    return true;
+  }
+
+  // the base period between mesh passes; 0 disables periodic meshing
   void setMeshPeriodMs(std::chrono::milliseconds period) {
     _meshPeriodMs = period;
+    _meshIntervalMs = period.count();
   }
 
+  // the current period between mesh passes, as adapted from the base
+  // period by updateMeshSchedule
+  std::chrono::milliseconds meshInterval() const {
+    return std::chrono::milliseconds(_meshIntervalMs.load(std::memory_order_relaxed));
+  }
+
+  // acquire every heap lock, e.g. to quiesce the heap around fork
   void lock() {
-    _miniheapLock.lock();
+    _meshLock.lock();
+    _parkedHeaps.lock();
+    for (size_t i = 0; i < kNumBins; i++) {
+      _miniheapLocks[i].lock();
+    }
+    _arenaLock.lock();
     // internal::Heap().lock();
   }
 
   void unlock() {
     // internal::Heap().unlock();
-    _miniheapLock.unlock();
+    _arenaLock.unlock();
+    for (size_t i = kNumBins; i > 0; i--) {
+      _miniheapLocks[i - 1].unlock();
+    }
+    _parkedHeaps.unlock();
+    _meshLock.unlock();
   }
 
   // PUBLIC ONLY FOR TESTING
-  // after call to meshLocked() completes src is a nullptr
+  // after call to meshLocked() completes src is a nullptr.  Must be
+  // called with the size class lock and _arenaLock held.
   void ATTRIBUTE_NEVER_INLINE meshLocked(MiniHeap *dst, MiniHeap *&src);
 
-  inline void ATTRIBUTE_ALWAYS_INLINE maybeMesh() {
+  // mesh each pair's second miniheap into its first, sharing the
+  // mprotect/mmap/fallocate calls of the whole batch.  The pairs must
+  // be disjoint; same locking as meshLocked.
+  void meshBatchLocked(internal::vector<std::pair<MiniHeap *, MiniHeap *>> &batch);
+
+  // called after frees of freedBytes bytes from detached miniheaps
+  // (or periodically, with 0): mesh if meshInterval() has passed since
+  // the last mesh.  With a background mesher we never mesh on the
+  // calling thread, and only wake the mesher up early after a burst
+  // of frees.
+  inline void ATTRIBUTE_ALWAYS_INLINE maybeMesh(size_t freedBytes = 0) {
     if (!kMeshingEnabled) {
       return;
     }
@@ -314,14 +499,29 @@ public:
       return;
     }
 
+    if (_backgroundMeshing.load(std::memory_order_relaxed)) {
+      if (freedBytes > 0) {
+        const auto before = _freedSinceMesh.fetch_add(freedBytes, std::memory_order_relaxed);
+        if (unlikely(before < kBackgroundMeshFreeTrigger && before + freedBytes >= kBackgroundMeshFreeTrigger)) {
+          requestBackgroundMesh();
+        }
+      }
+      return;
+    }
+
     const auto now = time::now();
     auto duration = chrono::duration_cast<chrono::milliseconds>(now - _lastMesh);
 
-    if (likely(duration < _meshPeriodMs)) {
+    if (likely(duration < meshInterval())) {
       return;
     }
 
-    lock_guard<mutex> lock(_miniheapLock);
+    // if another thread is already meshing there is nothing for us
+    // to do
+    unique_lock<mutex> lock(_meshLock, try_to_lock);
+    if (!lock.owns_lock()) {
+      return;
+    }
 
     {
       // ensure if two threads tried to grab the mesh lock at the same
@@ -330,18 +530,41 @@ public:
       const auto lockedNow = time::now();
       auto duration = chrono::duration_cast<chrono::milliseconds>(lockedNow - _lastMesh);
 
-      if (unlikely(duration < _meshPeriodMs)) {
+      if (unlikely(duration < meshInterval())) {
         return;
       }
     }
 
     _lastMesh = now;
 
-    meshAllSizeClasses();
+    meshAllSizeClasses(_maxPauseUs);
   }
 
+  // run by the mesher thread (see Runtime::startMesherThread): from
+  // here on, application threads leave meshing to it.  Never returns.
+  void ATTRIBUTE_NORETURN backgroundMeshLoop();
+
+  // the mesher thread doesn't survive fork, so the child meshes and
+  // scavenges inline again
+  void stopBackgroundMeshing() {
+    _backgroundMeshing = false;
+    Super::setDirtyDecay(false);
+  }
+
+  // how often the mesher thread runs a decay pass, kZeroMs if dirty
+  // page decay is off
+  std::chrono::milliseconds dirtyDecayTick() const {
+    const auto decayMs = _dirtyDecayMs.load(std::memory_order_relaxed);
+    if (decayMs == 0) {
+      return kZeroMs;
+    }
+    return std::chrono::milliseconds(std::max<size_t>(decayMs / kDirtyDecaySteps, 1));
+  }
+
+  // meshLocked holds _arenaLock while spans are read-only, so
+  // acquiring it waits out any in-progress mesh
   inline bool okToProceed(void *ptr) const {
-    lock_guard<mutex> lock(_miniheapLock);
+    lock_guard<mutex> lock(_arenaLock);
 
     if (ptr == nullptr)
       return false;
@@ -354,23 +577,111 @@ public:
   }
 
 private:
-  // check for meshes in all size classes -- must be called LOCKED
-  void meshAllSizeClasses();
+  // check for meshes in all size classes -- must be called with
+  // _meshLock held.  With a non-zero maxPauseUs the pass stops once it
+  // has run that long, and the next one picks up where it left off.
+  // With more than one worker (and no pause limit) size classes are
+  // meshed in parallel.
+  void meshAllSizeClasses(size_t maxPauseUs = 0, size_t workerCount = 1);
+
+  // find and perform meshes in one size class, adding them to
+  // meshCount.  Returns false if it stopped early because overBudget
+  // returned true.  Takes the size class lock and _arenaLock.
+  bool meshSizeClass(size_t sizeClass, MWC &prng, MeshMethod meshMethod, const function<bool()> &overBudget,
+                     size_t &meshCount);
+
+  // shared by the threads of a parallel mesh pass, which each take
+  // the next unmeshed size class until there are none left
+  struct ParallelMeshPass {
+    GlobalHeap *heap{nullptr};
+    MeshMethod meshMethod{kDefaultMeshMethod};
+    atomic_size_t nextClass{0};
+    atomic_size_t meshCount{0};
+  };
+
+  static void *parallelMeshWorker(void *arg);
+  void meshSizeClassesFrom(ParallelMeshPass &pass);
+  // returns the number of meshes performed
+  size_t meshSizeClassesParallel(MeshMethod meshMethod, size_t workerCount);
+
+  void ATTRIBUTE_NEVER_INLINE requestBackgroundMesh();
+  // wake the mesher thread to release every dirty page
+  void ATTRIBUTE_NEVER_INLINE requestBackgroundPurge();
+
+  // adapt the period between mesh passes to how productive the last
+  // one was and how much memory looks reclaimable -- with _meshLock
+  // held
+  void updateMeshSchedule(bool productive);
+
+  // candidates are paired up for meshing without the size class
+  // lock; these check that a pair can still be meshed.  Must be
+  // called with the size class lock and _arenaLock held.
+  bool isLiveCandidateLocked(const MiniHeap *mh, int sizeClass) const;
+  bool stillMeshableLocked(MiniHeap *dst, MiniHeap *src, int sizeClass) const;
+
+  // slowpath for freeFor when a free raced with meshing
+  void ATTRIBUTE_NEVER_INLINE freeForLocked(int sizeClass, void *ptr);
+  // update the BinnedTracker bin of a detached MiniHeap after ptr,
+  // one of its objects, was freed -- must be called with the size
+  // class lock held
+  void rebinLocked(MiniHeap *mh, void *ptr);
 
   const size_t _maxObjectSize;
   atomic_size_t _lastMeshEffective{0};
   atomic_size_t _meshPeriod{kDefaultMeshPeriod};
-
-  // always accessed with the mhRWLock exclusively locked
+  // a MeshMethod
+  atomic_size_t _meshMethod{static_cast<size_t>(kDefaultMeshMethod)};
+  // time budget for a periodic mesh pass, 0 for no limit
+  atomic_size_t _maxPauseUs{kDefaultMaxPauseUs};
+  // size class the next mesh pass starts at -- under _meshLock
+  size_t _meshResumeClass{0};
+
+  // always accessed with _arenaLock held
   size_t _miniheapCount{0};
 
   BinnedTracker _littleheaps[kNumBins];
-
-  mutable mutex _miniheapLock{};
+  // only touched by the thread meshing that size class, under _meshLock
+  MeshScratch _meshScratch[kNumBins]{};
+  TransferCache _transferCaches[kNumBins];
+  ParkedHeapPool _parkedHeaps{};
+
+  // serializes a size class's miniheaps moving between thread-local
+  // heaps, the BinnedTracker and meshing
+  mutable CachelineAlignedMutex _miniheapLocks[kNumBins]{};
+  // protects the page allocator, _mhAllocator and miniheap accounting
+  mutable mutex _arenaLock{};
+  // serializes mesh passes
+  mutex _meshLock{};
 
   GlobalHeapStats _stats{};
 
+  // used only with _meshLock held; the arena's own PRNG is used
+  // under _arenaLock
+  MWC _meshPrng{internal::seed(), internal::seed()};
+
+  // set once a mesher thread is running
+  atomic<bool> _backgroundMeshing{false};
+  // bytes freed to detached miniheaps since the mesher last ran
+  atomic_size_t _freedSinceMesh{0};
+  // wakes the mesher thread before its period is up
+  mutex _mesherLock{};
+  condition_variable _mesherCond{};
+  bool _meshRequested{false};
+  bool _purgeRequested{false};
+  // how long dirty pages stay free before the mesher thread returns
+  // them to the OS
+  atomic_size_t _dirtyDecayMs{kDefaultDirtyDecayMs};
+
   std::chrono::milliseconds _meshPeriodMs{kMeshPeriodMs};
+  // _meshPeriodMs, doubled or halved _meshBackoff times
+  atomic_size_t _meshIntervalMs{static_cast<size_t>(kMeshPeriodMs.count())};
+  atomic_size_t _meshAdaptive{kDefaultMeshAdaptive};
+  // bit i set: size class i's miniheaps are allocated from the huge
+  // page region (and so are never meshed)
+  atomic<uint32_t> _hugePageClasses{0};
+  // under _meshLock
+  int _meshBackoff{0};
+  size_t _lastFootprint{0};
   // XXX: should be atomic, but has exception spec?
   time::time_point _lastMesh;
 };
@@ -13,6 +13,7 @@
 #endif
 
 #include <atomic>
+#include <set>
 #include <unordered_set>
 
 #include <signal.h>
@@ -120,10 +121,6 @@ struct Span {
     return Span(offset + pageCount, restPageCount);
   }
 
-  uint32_t spanClass() const {
-    return std::min(length, kSpanClassCount) - 1;
-  }
-
   size_t byteLength() const {
     return length * kPageSize;
   }
@@ -159,8 +156,9 @@ inline void *MaskToPage(const void *ptr) {
   return reinterpret_cast<void *>(ptrval & (uintptr_t) ~(CPUInfo::PageSize - 1));
 }
 
-// efficiently copy data from srcFd to dstFd
-int copyFile(int dstFd, int srcFd, off_t off, size_t sz);
+// efficiently copy the sz bytes at off in srcFd to the same offset
+// in dstFd, returning the number of bytes copied (or -1 if none were)
+ssize_t copyFile(int dstFd, int srcFd, off_t off, size_t sz);
 
 // for mesh-internal data structures, like heap metadata
 class Heap : public ExactlyOneHeap<LockedHeap<PosixLockType, PartitionedHeap>> {
@@ -199,6 +197,9 @@ using unordered_set = std::unordered_set<K, hash<K>, equal_to<K>, STLAllocator<K
 template <typename K, typename V>
 using map = std::map<K, V, std::less<K>, STLAllocator<pair<const K, V>, Heap>>;
 
+template <typename K>
+using set = std::set<K, std::less<K>, STLAllocator<K, Heap>>;
+
 typedef std::basic_string<char, std::char_traits<char>, STLAllocator<char, Heap>> string;
 
 template <typename T>
@@ -14,9 +14,38 @@ static __attribute__((constructor)) void libmesh_init() {
   mesh::real::init();
 
   runtime().createSignalFd();
-  runtime().installSegfaultHandler();
+
+  // meshing traps writes with userfaultfd where the kernel supports
+  // it, unless asked to use mprotect and a SIGSEGV handler
+  char *userfaultfd = getenv("MESH_USERFAULTFD");
+  if (userfaultfd && !atoi(userfaultfd)) {
+    runtime().heap().disableUserfaultfd();
+  }
+  if (runtime().heap().needsSegfaultHandler()) {
+    runtime().installSegfaultHandler();
+  }
   runtime().initMaxMapCount();
 
+  // MESH_IO_URING=0 punches holes in the arena file synchronously
+  char *ioUring = getenv("MESH_IO_URING");
+  if (ioUring && !atoi(ioUring)) {
+    runtime().heap().disableAsyncPunching();
+  }
+
+  // MESH_NUMA=0 places memory as if the machine had a single node
+  char *numaStr = getenv("MESH_NUMA");
+  if (numaStr && !atoi(numaStr)) {
+    numa::disable();
+  }
+
+  // back large allocations (and optionally the size classes in
+  // MESH_HUGEPAGE_CLASSES, a bitmask) with transparent huge pages
+  char *hugePages = getenv("MESH_HUGEPAGES");
+  if (hugePages && atoi(hugePages)) {
+    char *hugePageClasses = getenv("MESH_HUGEPAGE_CLASSES");
+    runtime().heap().enableHugePages(hugePageClasses ? strtoul(hugePageClasses, nullptr, 0) : 0);
+  }
+
   char *meshPeriodStr = getenv("MESH_PERIOD_MS");
   if (meshPeriodStr) {
     long period = strtol(meshPeriodStr, nullptr, 10);
@@ -26,6 +55,11 @@ static __attribute__((constructor)) void libmesh_init() {
     runtime().setMeshPeriodMs(std::chrono::milliseconds{period});
   }
 
+  char *mesherThread = getenv("MESH_BACKGROUND_MESHER");
+  if (mesherThread && atoi(mesherThread)) {
+    runtime().startMesherThread();
+  }
+
   char *bgThread = getenv("MESH_BACKGROUND_THREAD");
   if (!bgThread)
     return;
@@ -50,45 +84,98 @@ static __attribute__((destructor)) void libmesh_fini() {
 }
 
 namespace mesh {
+// with per-CPU heaps, threads with an rseq registration never get a
+// fast-path heap, so every call lands in one of these slowpaths.
 ATTRIBUTE_NEVER_INLINE
 static void *allocSlowpath(size_t sz) {
+  if (kPerCPUHeaps) {
+    return CPULocalHeaps::WithHeap([&](ThreadLocalHeap *heap) { return heap->malloc(sz); });
+  }
+
   ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
   return localHeap->malloc(sz);
 }
 
 ATTRIBUTE_NEVER_INLINE
 static void *cxxNewSlowpath(size_t sz) {
+  if (kPerCPUHeaps) {
+    return CPULocalHeaps::WithHeap([&](ThreadLocalHeap *heap) { return heap->cxxNew(sz); });
+  }
+
   ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
   return localHeap->cxxNew(sz);
 }
 
 ATTRIBUTE_NEVER_INLINE
 static void freeSlowpath(void *ptr) {
+  if (kPerCPUHeaps && CPULocalHeaps::CurrentCPU() >= 0) {
+    CPULocalHeaps::WithHeap([&](ThreadLocalHeap *heap) { heap->free(ptr); });
+    return;
+  }
+
   // instead of instantiating a thread-local heap on free, just free
   // to the global heap directly
   runtime().heap().free(ptr);
 }
 
+ATTRIBUTE_NEVER_INLINE
+static size_t mallocBatchSlowpath(size_t sz, void **ptrs, size_t count) {
+  if (kPerCPUHeaps) {
+    return CPULocalHeaps::WithHeap([&](ThreadLocalHeap *heap) { return heap->mallocBatch(sz, ptrs, count); });
+  }
+
+  ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
+  return localHeap->mallocBatch(sz, ptrs, count);
+}
+
+ATTRIBUTE_NEVER_INLINE
+static void freeBatchSlowpath(void **ptrs, size_t count) {
+  if (kPerCPUHeaps && CPULocalHeaps::CurrentCPU() >= 0) {
+    CPULocalHeaps::WithHeap([&](ThreadLocalHeap *heap) { heap->freeBatch(ptrs, count); });
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    runtime().heap().free(ptrs[i]);
+  }
+}
+
 ATTRIBUTE_NEVER_INLINE
 static void *reallocSlowpath(void *oldPtr, size_t newSize) {
+  if (kPerCPUHeaps) {
+    return CPULocalHeaps::WithHeap([&](ThreadLocalHeap *heap) { return heap->realloc(oldPtr, newSize); });
+  }
+
   ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
   return localHeap->realloc(oldPtr, newSize);
 }
 
 ATTRIBUTE_NEVER_INLINE
 static void *callocSlowpath(size_t count, size_t size) {
+  if (kPerCPUHeaps) {
+    return CPULocalHeaps::WithHeap([&](ThreadLocalHeap *heap) { return heap->calloc(count, size); });
+  }
+
   ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
   return localHeap->calloc(count, size);
 }
 
 ATTRIBUTE_NEVER_INLINE
 static size_t usableSizeSlowpath(void *ptr) {
+  if (kPerCPUHeaps) {
+    return CPULocalHeaps::WithHeap([&](ThreadLocalHeap *heap) { return heap->getSize(ptr); });
+  }
+
   ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
   return localHeap->getSize(ptr);
 }
 
 ATTRIBUTE_NEVER_INLINE
 static void *memalignSlowpath(size_t alignment, size_t size) {
+  if (kPerCPUHeaps) {
+    return CPULocalHeaps::WithHeap([&](ThreadLocalHeap *heap) { return heap->memalign(alignment, size); });
+  }
+
   ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
   return localHeap->memalign(alignment, size);
 }
@@ -125,6 +212,25 @@ extern "C" MESH_EXPORT CACHELINE_ALIGNED_FN void mesh_sized_free(void *ptr, size
   return localHeap->sizedFree(ptr, sz);
 }
 
+extern "C" MESH_EXPORT CACHELINE_ALIGNED_FN size_t mesh_malloc_batch(size_t sz, void **ptrs, size_t count) {
+  ThreadLocalHeap *localHeap = ThreadLocalHeap::GetFastPathHeap();
+  if (unlikely(localHeap == nullptr)) {
+    return mesh::mallocBatchSlowpath(sz, ptrs, count);
+  }
+
+  return localHeap->mallocBatch(sz, ptrs, count);
+}
+
+extern "C" MESH_EXPORT CACHELINE_ALIGNED_FN void mesh_free_batch(void **ptrs, size_t count) {
+  ThreadLocalHeap *localHeap = ThreadLocalHeap::GetFastPathHeap();
+  if (unlikely(localHeap == nullptr)) {
+    mesh::freeBatchSlowpath(ptrs, count);
+    return;
+  }
+
+  localHeap->freeBatch(ptrs, count);
+}
+
 extern "C" MESH_EXPORT CACHELINE_ALIGNED_FN void *mesh_realloc(void *oldPtr, size_t newSize) {
   ThreadLocalHeap *localHeap = ThreadLocalHeap::GetFastPathHeap();
   if (unlikely(localHeap == nullptr)) {
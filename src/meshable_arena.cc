@@ -14,11 +14,14 @@
 
 #include <unistd.h>
 
-//#include <sys/memfd.h>
-#include <asm/unistd_64.h>
 #include <linux/memfd.h>
 #endif
 
+#ifdef __linux__
+#include <linux/userfaultfd.h>
+#include <sys/syscall.h>
+#endif
+
 #include <sys/ioctl.h>
 
 #include <algorithm>
@@ -28,6 +31,7 @@
 #include "mini_heap.h"
 
 #include "runtime.h"
+#include "thread_local_heap.h"
 
 namespace mesh {
 
@@ -42,29 +46,35 @@ MeshableArena::MeshableArena() : SuperHeap(), _fastPrng(internal::seed(), intern
   d_assert(arenaInstance == nullptr);
   arenaInstance = this;
 
+  numa::init();
+
   int fd = -1;
   if (kMeshingEnabled) {
-    fd = openSpanFile(kArenaSize);
+    // sized for every segment up front: it is sparse, and sealed
+    // against growing
+    fd = openSpanFile(kMaxArenaSize);
     if (fd < 0) {
       debug("mesh: opening arena file failed.\n");
       abort();
     }
   }
   _fd = fd;
-  _arenaBegin = SuperHeap::map(kArenaSize, kMapShared, fd);
-  _mhIndex = reinterpret_cast<atomic<MiniHeapID> *>(SuperHeap::malloc(indexSize()));
 
-  hard_assert(_arenaBegin != nullptr);
-  hard_assert(_mhIndex != nullptr);
+  // reserve address space (but no memory) for every segment, so that
+  // the arena stays contiguous as it grows
+  void *reservation = mmap(nullptr, kMaxArenaSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  hard_assert_msg(reservation != MAP_FAILED, "arena reservation failed: %d", errno);
+  _arenaBegin = reservation;
+  mapSegment();
 
-  if (kAdviseDump) {
-    madvise(_arenaBegin, kArenaSize, MADV_DONTDUMP);
+  if (kMeshingEnabled) {
+    openUserfaultfd();
+    _punchRing.init();
   }
 
   // debug("MeshableArena(%p): fd:%4d\t%p-%p\n", this, fd, _arenaBegin, arenaEnd());
 
   // TODO: move this to runtime
-  atexit(staticAtExit);
   pthread_atfork(staticPrepareForFork, staticAfterForkParent, staticAfterForkChild);
 }
 
@@ -100,104 +110,93 @@ char *MeshableArena::openSpanDir(int pid) {
   return nullptr;
 }
 
-void MeshableArena::expandArena(size_t minPagesAdded) {
-  const size_t pageCount = std::max(minPagesAdded, kMinArenaExpansion);
+void MeshableArena::mapSegment() {
+  if (unlikely(_segmentCount == kMaxArenaSegments)) {
+    debug("Mesh: arena exhausted: current arena size is %.1f GB; recompile with more arena segments.",
+          kMaxArenaSize / 1024.0 / 1024.0 / 1024.0);
+    abort();
+  }
 
-  Span expansion(_end, pageCount);
-  _end += pageCount;
+  const size_t segmentOff = _segmentCount * kArenaSize;
+  void *segment = reinterpret_cast<char *>(_arenaBegin) + segmentOff;
+  void *ptr = mmap(segment, kArenaSize, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd,
+                   kMeshingEnabled ? segmentOff : 0);
+  hard_assert_msg(ptr != MAP_FAILED, "arena segment map failed: %d", errno);
 
-  if (unlikely(_end >= kArenaSize / kPageSize)) {
-    debug("Mesh: arena exhausted: current arena size is %.1f GB; recompile with larger arena size.",
-          kArenaSize / 1024.0 / 1024.0 / 1024.0);
-    abort();
+  if (kAdviseDump) {
+    madvise(segment, kArenaSize, MADV_DONTDUMP);
   }
 
-  _clean[expansion.spanClass()].push_back(expansion);
+  _segmentCount++;
 }
 
-bool MeshableArena::findPagesInner(internal::vector<Span> freeSpans[kSpanClassCount], const size_t i,
-                                   const size_t pageCount, Span &result) {
-  internal::vector<Span> &spanList = freeSpans[i];
-  if (spanList.empty())
-    return false;
+void MeshableArena::addExpansion(const Span &span, uint32_t node) {
+  _pageMap.ensure(span.offset, span.length);
 
-  size_t oldLen = spanList.size();
+  const size_t lastChunk = (span.offset + span.length - 1) / kMinArenaExpansion;
+  for (size_t chunk = span.offset / kMinArenaExpansion; chunk <= lastChunk; chunk++) {
+    _chunkNode[chunk] = node;
+  }
+  numa::bind(ptrFromOffset(span.offset), span.byteLength(), node);
 
-  if (i == kSpanClassCount - 1 && spanList.back().length < pageCount) {
-    // the final span class contains (and is the only class to
-    // contain) variable-size spans, so we need to make sure we
-    // search through all candidates in this case.
-    for (size_t j = 0; j < spanList.size() - 1; j++) {
-      if (spanList[j].length >= pageCount) {
-        std::swap(spanList[j], spanList.back());
-        break;
-      }
-    }
+  _clean[node].add(span);
+}
 
-    // check that we found something in the above loop. this would be
-    // our last loop iteration anyway
-    if (spanList.back().length < pageCount) {
-      return false;
+void MeshableArena::expandArena(size_t minPagesAdded, uint32_t node) {
+  // whole chunks, so that each chunk's pages are on a single node
+  const size_t pageCount = (minPagesAdded + kMinArenaExpansion - 1) / kMinArenaExpansion * kMinArenaExpansion;
+
+  // the huge page region ends the first segment's file-backed pages:
+  // what's left below it is too small, so go on in the second segment
+  if (_hugeBegin != 0 && _end < kSegmentPages && _end + pageCount > _hugeBegin) {
+    if (_end < _hugeBegin) {
+      addExpansion(Span(_end, _hugeBegin - _end), node);
     }
+    _end = kSegmentPages;
   }
 
-  Span span = spanList.back();
-  spanList.pop_back();
-
-#ifndef NDEBUG
-  d_assert_msg(oldLen == spanList.size() + 1, "pageCount:%zu,%zu -- %zu/%zu", pageCount, i, oldLen, spanList.size());
-  for (size_t j = 0; j < spanList.size(); j++) {
-    d_assert(spanList[j] != span);
+  while (_end + pageCount > _segmentCount * kSegmentPages) {
+    mapSegment();
   }
-#endif
 
-  // this invariant should be maintained
-  d_assert(span.length >= i + 1);
-  d_assert(span.length >= pageCount);
-
-  // put the part we don't need back in the reuse pile
-  Span rest = span.splitAfter(pageCount);
-  if (!rest.empty()) {
-    freeSpans[rest.spanClass()].push_back(rest);
-  }
-  d_assert(span.length == pageCount);
+  const Span expansion(_end, pageCount);
+  _end += pageCount;
 
-  result = span;
-  return true;
+  addExpansion(expansion, node);
 }
 
-bool MeshableArena::findPages(const size_t pageCount, Span &result, internal::PageType &type) {
+bool MeshableArena::findPages(const size_t pageCount, const uint32_t node, Span &result, internal::PageType &type) {
   // Search through all dirty spans first.  We don't worry about
   // fragmenting dirty pages, as being able to reuse dirty pages means
   // we don't increase RSS.
-  for (size_t i = Span(0, pageCount).spanClass(); i < kSpanClassCount; i++) {
-    if (findPagesInner(_dirty, i, pageCount, result)) {
-      type = internal::PageType::Dirty;
-      return true;
-    }
+  if (_dirty[node].takeBestFit(pageCount, result)) {
+    _dirtyPageCount -= std::min(_dirtyPageCount, pageCount);
+    type = internal::PageType::Dirty;
+    return true;
   }
 
   // if no dirty pages are available, search clean pages.  An allocated
   // clean page (once it is written to) means an increased RSS.
-  for (size_t i = Span(0, pageCount).spanClass(); i < kSpanClassCount; i++) {
-    if (findPagesInner(_clean, i, pageCount, result)) {
-      type = internal::PageType::Clean;
-      return true;
-    }
+  if (_clean[node].takeBestFit(pageCount, result)) {
+    type = internal::PageType::Clean;
+    return true;
   }
 
   return false;
 }
 
-Span MeshableArena::reservePages(const size_t pageCount, const size_t pageAlignment) {
+Span MeshableArena::reservePages(const size_t pageCount, const size_t pageAlignment, const uint32_t node,
+                                 internal::PageType &flags) {
   d_assert(pageCount >= 1);
 
-  internal::PageType flags(internal::PageType::Unknown);
+  // only pages on the caller's node are reused: we would rather grow
+  // the arena than hand out remote memory
+  flags = internal::PageType::Unknown;
   Span result(0, 0);
-  auto ok = findPages(pageCount, result, flags);
+  auto ok = findPages(pageCount, node, result, flags);
   if (!ok) {
-    expandArena(pageCount);
-    ok = findPages(pageCount, result, flags);
+    expandArena(pageCount, node);
+    ok = findPages(pageCount, node, result, flags);
     hard_assert(ok);
   }
 
@@ -208,7 +207,7 @@ Span MeshableArena::reservePages(const size_t pageCount, const size_t pageAlignm
     freeSpan(result, flags);
     // recurse once, asking for enough extra space that we are sure to
     // be able to find an aligned offset of pageCount pages within.
-    result = reservePages(pageCount + 2 * pageAlignment, 1);
+    result = reservePages(pageCount + 2 * pageAlignment, 1, node, flags);
 
     const size_t alignment = pageAlignment * kPageSize;
     const uintptr_t alignedPtr = (ptrvalFromOffset(result.offset) + alignment - 1) & ~(alignment - 1);
@@ -227,19 +226,6 @@ Span MeshableArena::reservePages(const size_t pageCount, const size_t pageAlignm
   return result;
 }
 
-template <typename Func>
-static void forEachFree(const internal::vector<Span> freeSpans[kSpanClassCount], const Func func) {
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    if (freeSpans[i].empty())
-      continue;
-
-    for (size_t j = 0; j < freeSpans[i].size(); j++) {
-      auto span = freeSpans[i][j];
-      func(span);
-    }
-  }
-}
-
 internal::RelaxedBitmap MeshableArena::allocatedBitmap(bool includeDirty) const {
   internal::RelaxedBitmap bitmap(_end);
 
@@ -261,14 +247,17 @@ internal::RelaxedBitmap MeshableArena::allocatedBitmap(bool includeDirty) const
     }
   };
 
-  if (includeDirty)
-    forEachFree(_dirty, unmarkPages);
-  forEachFree(_clean, unmarkPages);
+  for (size_t node = 0; node < kMaxNumaNodes; node++) {
+    if (includeDirty)
+      _dirty[node].forEach(unmarkPages);
+    _clean[node].forEach(unmarkPages);
+  }
 
   return bitmap;
 }
 
-char *MeshableArena::pageAlloc(Span &result, size_t pageCount, size_t pageAlignment) {
+char *MeshableArena::pageAlloc(Span &result, size_t pageCount, size_t pageAlignment, internal::PageType &type,
+                               bool hugePages) {
   if (pageCount == 0) {
     return nullptr;
   }
@@ -278,12 +267,20 @@ char *MeshableArena::pageAlloc(Span &result, size_t pageCount, size_t pageAlignm
   d_assert(pageCount >= 1);
   d_assert(pageCount < std::numeric_limits<Length>::max());
 
-  auto span = reservePages(pageCount, pageAlignment);
+  // make the spans whose punches have completed reusable
+  if (unlikely(_punchRing.inFlight() > 0)) {
+    reapPunches(false);
+  }
+
+  Span span(0, 0);
+  if (!hugePages || _hugeBegin == 0 || !hugePageAlloc(span, pageCount, pageAlignment, type)) {
+    span = reservePages(pageCount, pageAlignment, numa::currentNode(), type);
+  }
   d_assert(isAligned(span, pageAlignment));
 
   d_assert(contains(ptrFromOffset(span.offset)));
 #ifndef NDEBUG
-  if (_mhIndex[span.offset].load().hasValue()) {
+  if (_pageMap.get(span.offset).hasValue()) {
     mesh::debug("----\n");
     auto mh = reinterpret_cast<MiniHeap *>(miniheapForArenaOffset(span.offset));
     mh->dumpDebug();
@@ -311,120 +308,352 @@ void MeshableArena::free(void *ptr, size_t sz, internal::PageType type) {
   d_assert(sz % kPageSize == 0);
 
   const Span span(offsetFor(ptr), sz / kPageSize);
+  if (inHugePageArena(span.offset)) {
+    hugePageFree(span, type);
+    return;
+  }
   freeSpan(span, type);
 }
 
-void MeshableArena::partialScavenge() {
-  forEachFree(_dirty, [&](const Span &span) {
-    auto ptr = ptrFromOffset(span.offset);
-    auto sz = span.byteLength();
-    madvise(ptr, sz, MADV_DONTNEED);
-    freePhys(ptr, sz);
-    // don't coalesce, just add to clean
-    _clean[span.spanClass()].push_back(span);
-  });
+bool MeshableArena::extendInPlace(Span &span, const size_t extraPages) {
+  d_assert(extraPages > 0);
+
+  const Offset following = span.offset + span.length;
+
+  if (inHugePageArena(span.offset)) {
+    if (!takeFollowingHugePages(following, extraPages)) {
+      return false;
+    }
+  } else {
+    // the following pages may be split between dirty and clean spans,
+    // so check they add up first.  Growing into the end of the arena
+    // (e.g. a log buffer that was the last thing allocated) is always
+    // possible.
+    const auto node = nodeForOffset(span.offset);
+    bool expanded = false;
+    for (size_t found = 0; found < extraPages;) {
+      const Offset off = following + found;
+      if (off == _end && !expanded) {
+        // the expansion may coalesce with the span we were looking at
+        expandArena(extraPages - found, node);
+        expanded = true;
+        found = 0;
+        continue;
+      }
+      const size_t len = std::max(_dirty[node].lengthAt(off), _clean[node].lengthAt(off));
+      if (len == 0) {
+        return false;
+      }
+      found += len;
+    }
 
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    _dirty[i].clear();
+    for (size_t taken = 0; taken < extraPages;) {
+      const Offset off = following + taken;
+      const size_t len = std::min(std::max(_dirty[node].lengthAt(off), _clean[node].lengthAt(off)), extraPages - taken);
+      if (_dirty[node].takeAt(off, len)) {
+        _dirtyPageCount -= std::min(_dirtyPageCount, len);
+      } else {
+        const bool ok = _clean[node].takeAt(off, len);
+        hard_assert(ok);
+      }
+      taken += len;
+    }
   }
 
-  _dirtyPageCount = 0;
+  if (kAdviseDump) {
+    madvise(ptrFromOffset(following), extraPages * kPageSize, MADV_DODUMP);
+  }
+
+  span.length += extraPages;
+  return true;
 }
 
-void MeshableArena::scavenge(bool force) {
-  if (!force && _dirtyPageCount < kMinDirtyPageThreshold) {
-    return;
+void MeshableArena::releaseDirty(uint32_t minAge) {
+  size_t released = 0;
+  for (size_t node = 0; node < kMaxNumaNodes; node++) {
+    _dirty[node].takeOlderThan(_decayEpoch, minAge, [&](const Span &span) {
+      madvise(ptrFromOffset(span.offset), span.byteLength(), MADV_DONTNEED);
+      punchSpan(span, true);
+      released += span.length;
+    });
   }
+  submitPunches();
 
-  // the inverse of the allocated bitmap is all of the spans in _clear
-  // (since we just MADV_DONTNEED'ed everything in dirty)
-  auto bitmap = allocatedBitmap(false);
-  bitmap.invert();
+  released += hugePageScavenge(minAge);
 
-  auto markPages = [&](const Span &span) {
-    for (size_t k = 0; k < span.length; k++) {
-#ifndef NDEBUG
-      if (bitmap.isSet(span.offset + k)) {
-        debug("arena: bit %zu already set (%zu/%zu) %zu\n", k, span.offset, span.length, bitmap.bitCount());
-      }
-#endif
-      bitmap.tryToSet(span.offset + k);
-    }
-  };
+  _dirtyPageCount -= std::min(_dirtyPageCount, released);
+}
 
-  // first, untrack the spans in the meshed bitmap and mark them in
-  // the (method-local) unallocated bitmap
-  std::for_each(_toReset.begin(), _toReset.end(), [&](Span span) {
-    untrackMeshed(span);
-    markPages(span);
-    resetSpanMapping(span);
-  });
+void MeshableArena::partialScavenge() {
+  releaseDirty(0);
+}
+
+void MeshableArena::decayScavenge() {
+  // pages freed in the epoch we're leaving have aged by one step
+  _decayEpoch++;
 
-  // now that we've finally reset to identity all delayed-reset
-  // mappings, empty the list
-  _toReset.clear();
+  if (_purgeRequested) {
+    _purgeRequested = false;
+    releaseDirty(0);
+  } else {
+    releaseDirty(kDirtyDecaySteps);
+  }
+}
+
+void MeshableArena::scavenge(bool force) {
+  if (!force && _dirtyPageCount < kMinDirtyPageThreshold && _toReset.empty()) {
+    return;
+  }
 
-  _meshedPageCount = _meshedBitmap.inUseCount();
+  if (_punchRing.inFlight() > 0) {
+    reapPunches(false);
+  }
+  if (force) {
+    drainPunches();
+  }
+
+  // first, untrack the spans in the meshed bitmap and restore their
+  // identity mappings: their own file pages were punched out when
+  // they were meshed, so they are clean.  A late punch would wipe out
+  // whatever the span is reused for, so while any are in flight this
+  // waits for a later scavenge.
+  if (_meshPunches == 0) {
+    std::for_each(_toReset.begin(), _toReset.end(), [&](Span span) {
+      untrackMeshed(span);
+      resetSpanMapping(span);
+      _clean[nodeForOffset(span.offset)].add(span);
+    });
+
+    // now that we've finally reset to identity all delayed-reset
+    // mappings, empty the list
+    _toReset.clear();
+  }
+
+  // _meshedPageCount is kept up to date by (un)trackMeshed, rather
+  // than counted from the bitmap, which covers the whole reservation
   if (_meshedPageCount > _meshedPageCountHWM) {
     _meshedPageCountHWM = _meshedPageCount;
     // TODO: find rss at peak
   }
 
-  forEachFree(_dirty, [&](const Span &span) {
-    auto ptr = ptrFromOffset(span.offset);
-    auto sz = span.byteLength();
-    madvise(ptr, sz, MADV_DONTNEED);
-    freePhys(ptr, sz);
-    markPages(span);
-  });
+  // decaying dirty pages are left to decayScavenge
+  if (force || !_dirtyDecay) {
+    partialScavenge();
+  }
+}
 
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    _dirty[i].clear();
+bool MeshableArena::enableHugePages() {
+  if (_hugeBegin != 0) {
+    return true;
   }
 
-  _dirtyPageCount = 0;
+  // the region has to start on a huge page boundary for the kernel to
+  // back any of it with huge pages
+  const uintptr_t arenaEnd = reinterpret_cast<uintptr_t>(_arenaBegin) + kArenaSize;
+  const uintptr_t begin = (arenaEnd - kHugePageArenaSize + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  const Offset beginOff = offsetFor(reinterpret_cast<void *>(begin));
+  if (_end >= beginOff) {
+    return false;
+  }
+
+  // private and anonymous: we never remap or punch holes in these
+  // pages, so they don't need to live in the arena file
+  void *ptr = mmap(reinterpret_cast<void *>(begin), arenaEnd - begin, HL_MMAP_PROTECTION_MASK,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+  hard_assert_msg(ptr != MAP_FAILED, "huge page region map failed: %d", errno);
 
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    _clean[i].clear();
+#ifdef MADV_HUGEPAGE
+  madvise(ptr, arenaEnd - begin, MADV_HUGEPAGE);
+#endif
+  if (kAdviseDump) {
+    madvise(ptr, arenaEnd - begin, MADV_DONTDUMP);
   }
 
-  // coalesce adjacent spans
-  Span current(0, 0);
-  for (auto const &i : bitmap) {
-    if (i == current.offset + current.length) {
-      current.length++;
+  _hugeBegin = beginOff;
+  _hugeEnd = beginOff;
+
+  return true;
+}
+
+bool MeshableArena::hugePageAlloc(Span &result, const size_t pageCount, size_t pageAlignment,
+                                  internal::PageType &type) {
+  // keep large allocations from straddling huge pages they don't need
+  static constexpr size_t kHugePageCount = kHugePageSize / kPageSize;
+  if (pageCount >= kHugePageCount) {
+    pageAlignment = std::max(pageAlignment, kHugePageCount);
+  }
+  const uintptr_t alignment = pageAlignment * kPageSize;
+  auto alignUp = [&](Offset off) -> Offset {
+    const uintptr_t ptrval = (ptrvalFromOffset(off) + alignment - 1) & ~(alignment - 1);
+    return offsetFor(reinterpret_cast<void *>(ptrval));
+  };
+
+  // first fit, treating adjacent clean and dirty spans as one
+  for (size_t i = 0; i < _hugeFree.size(); i++) {
+    size_t last = i;
+    Offset end = _hugeFree[i].span.offset + _hugeFree[i].span.length;
+    bool dirty = _hugeFree[i].dirty;
+    uint32_t epoch = _hugeFree[i].epoch;
+    const Offset aligned = alignUp(_hugeFree[i].span.offset);
+    while (aligned + pageCount > end && last + 1 < _hugeFree.size() && _hugeFree[last + 1].span.offset == end) {
+      last++;
+      end += _hugeFree[last].span.length;
+      dirty = dirty || _hugeFree[last].dirty;
+      epoch = FreeSpanMap::newerEpoch(epoch, _hugeFree[last].epoch);
+    }
+    if (aligned + pageCount > end) {
+      i = last;
       continue;
     }
 
-    // should only be empty the first time/iteration through
-    if (!current.empty()) {
-      _clean[current.spanClass()].push_back(current);
-      // debug("  clean: %4zu/%4zu\n", current.offset, current.length);
+    const Offset begin = _hugeFree[i].span.offset;
+    _hugeFree.erase(_hugeFree.begin() + i, _hugeFree.begin() + last + 1);
+    if (aligned + pageCount < end) {
+      _hugeFree.emplace(_hugeFree.begin() + i, Span(aligned + pageCount, end - aligned - pageCount), dirty, epoch);
+    }
+    if (begin < aligned) {
+      _hugeFree.emplace(_hugeFree.begin() + i, Span(begin, aligned - begin), dirty, epoch);
     }
 
-    current = Span(i, 1);
+    if (dirty) {
+      _dirtyPageCount -= std::min<size_t>(_dirtyPageCount, pageCount);
+    }
+    type = dirty ? internal::PageType::Dirty : internal::PageType::Clean;
+    result = Span(aligned, pageCount);
+    return true;
   }
 
-  // should only be empty the first time/iteration through
-  if (!current.empty()) {
-    _clean[current.spanClass()].push_back(current);
-    // debug("  clean: %4zu/%4zu\n", current.offset, current.length);
+  const Offset aligned = alignUp(_hugeEnd);
+  if (aligned + pageCount > kSegmentPages) {
+    return false;
   }
-#ifndef NDEBUG
-  auto newBitmap = allocatedBitmap();
-  newBitmap.invert();
+  if (_hugeEnd < aligned) {
+    hugePageFree(Span(_hugeEnd, aligned - _hugeEnd), internal::PageType::Clean);
+  }
+  _pageMap.ensure(aligned, pageCount);
+  _hugeEnd = aligned + pageCount;
+
+  type = internal::PageType::Clean;
+  result = Span(aligned, pageCount);
+  return true;
+}
+
+void MeshableArena::hugePageFree(const Span &span, const internal::PageType type) {
+  d_assert(inHugePageArena(span.offset));
+  d_assert(type != internal::PageType::Meshed);
 
-  const size_t *bits1 = bitmap.bits();
-  const size_t *bits2 = newBitmap.bits();
-  for (size_t i = 0; i < bitmap.byteCount() / sizeof(size_t); i++) {
-    if (bits1[i] != bits2[i]) {
-      debug("bitmaps don't match %zu:\n", i);
-      debug("\t%s\n", bitmap.to_string().c_str());
-      debug("\t%s\n", newBitmap.to_string().c_str());
-      hard_assert(false);
+  const bool dirty = type != internal::PageType::Clean;
+  if (dirty) {
+    clearIndex(span);
+    if (kAdviseDump) {
+      madvise(ptrFromOffset(span.offset), span.byteLength(), MADV_DONTDUMP);
     }
+    _dirtyPageCount += span.length;
   }
-#endif
+
+  auto next = std::lower_bound(_hugeFree.begin(), _hugeFree.end(), span.offset,
+                               [](const HugeFreeSpan &free, Offset off) { return free.span.offset < off; });
+  d_assert(next == _hugeFree.end() || next->span.offset >= span.offset + span.length);
+
+  const bool mergePrev = next != _hugeFree.begin() && (next - 1)->dirty == dirty &&
+                         (next - 1)->span.offset + (next - 1)->span.length == span.offset;
+  const bool mergeNext =
+      next != _hugeFree.end() && next->dirty == dirty && next->span.offset == span.offset + span.length;
+  if (mergePrev && mergeNext) {
+    (next - 1)->span.length += span.length + next->span.length;
+    (next - 1)->epoch = _decayEpoch;
+    _hugeFree.erase(next);
+  } else if (mergePrev) {
+    (next - 1)->span.length += span.length;
+    (next - 1)->epoch = _decayEpoch;
+  } else if (mergeNext) {
+    next->span.offset = span.offset;
+    next->span.length += span.length;
+    next->epoch = _decayEpoch;
+  } else {
+    _hugeFree.emplace(next, span, dirty, _decayEpoch);
+  }
+
+  if (dirty && _dirtyPageCount > kMaxDirtyPageThreshold) {
+    if (_dirtyDecay) {
+      _purgeRequested = true;
+    } else {
+      partialScavenge();
+    }
+  }
+}
+
+bool MeshableArena::takeFollowingHugePages(const Offset offset, const size_t pageCount) {
+  if (offset == _hugeEnd) {
+    if (offset + pageCount > kSegmentPages) {
+      return false;
+    }
+    _pageMap.ensure(offset, pageCount);
+    _hugeEnd += pageCount;
+    return true;
+  }
+
+  auto free = std::lower_bound(_hugeFree.begin(), _hugeFree.end(), offset,
+                               [](const HugeFreeSpan &free, Offset off) { return free.span.offset < off; });
+  if (free == _hugeFree.end() || free->span.offset != offset || free->span.length < pageCount) {
+    return false;
+  }
+
+  if (free->dirty) {
+    _dirtyPageCount -= std::min<size_t>(_dirtyPageCount, pageCount);
+  }
+  if (free->span.length == pageCount) {
+    _hugeFree.erase(free);
+  } else {
+    free->span.offset += pageCount;
+    free->span.length -= pageCount;
+  }
+  return true;
+}
+
+size_t MeshableArena::hugePageScavenge(uint32_t minAge) {
+  if (_hugeBegin == 0) {
+    return 0;
+  }
+
+  // release only the huge pages entirely inside each dirty span:
+  // dropping part of one would make the kernel split the huge page
+  // under whatever is still allocated next to it.  The scraps at
+  // either end stay dirty.
+  internal::vector<HugeFreeSpan> scavenged{};
+  scavenged.reserve(_hugeFree.size());
+  size_t released = 0;
+  for (const auto &free : _hugeFree) {
+    const uintptr_t ptrval = ptrvalFromOffset(free.span.offset);
+    const uintptr_t begin = (ptrval + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    const uintptr_t end = (ptrval + free.span.byteLength()) & ~(kHugePageSize - 1);
+    if (!free.dirty || end <= begin || static_cast<uint32_t>(_decayEpoch - free.epoch) < minAge) {
+      scavenged.push_back(free);
+      continue;
+    }
+
+    madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+
+    const Offset cleanOff = offsetFor(reinterpret_cast<void *>(begin));
+    const Offset cleanEnd = offsetFor(reinterpret_cast<void *>(end));
+    released += cleanEnd - cleanOff;
+    if (free.span.offset < cleanOff) {
+      scavenged.emplace_back(Span(free.span.offset, cleanOff - free.span.offset), true, free.epoch);
+    }
+    if (!scavenged.empty() && !scavenged.back().dirty &&
+        scavenged.back().span.offset + scavenged.back().span.length == cleanOff) {
+      scavenged.back().span.length += cleanEnd - cleanOff;
+    } else {
+      scavenged.emplace_back(Span(cleanOff, cleanEnd - cleanOff), false);
+    }
+    const Offset freeEnd = free.span.offset + free.span.length;
+    if (cleanEnd < freeEnd) {
+      scavenged.emplace_back(Span(cleanEnd, freeEnd - cleanEnd), true, free.epoch);
+    }
+  }
+
+  _hugeFree = std::move(scavenged);
+  return released;
 }
 
 void MeshableArena::freePhys(void *ptr, size_t sz) {
@@ -443,32 +672,267 @@ void MeshableArena::freePhys(void *ptr, size_t sz) {
 #endif
 }
 
-void MeshableArena::beginMesh(void *keep, void *remove, size_t sz) {
-  int r = mprotect(remove, sz, PROT_READ);
+// a punch's io_uring tag: the span, and whether it goes on the clean
+// list once punched.  Spans are shorter than 2^31 pages.
+static constexpr uint64_t kPunchToClean = uint64_t{1} << 63;
+
+void MeshableArena::punchSpan(const Span &span, bool toClean) {
+  if (_punchRing.enabled() && !_punchUnsupported) {
+    const uint64_t tag = (toClean ? kPunchToClean : 0) | (uint64_t{span.length} << 32) | span.offset;
+    while (!_punchRing.queue(_fd, span.offset * kPageSize, span.byteLength(), tag)) {
+      // the ring is full
+      reapPunches(true);
+    }
+    if (!toClean) {
+      _meshPunches++;
+    }
+    return;
+  }
+
+  freePhys(ptrFromOffset(span.offset), span.byteLength());
+  if (toClean) {
+    _clean[nodeForOffset(span.offset)].add(span);
+  }
+}
+
+void MeshableArena::submitPunches() {
+  if (_punchRing.enabled()) {
+    _punchRing.submit();
+  }
+}
+
+void MeshableArena::reapPunches(bool wait) {
+  static constexpr size_t kReapBatch = 64;
+  uint64_t tags[kReapBatch];
+  int results[kReapBatch];
+
+  size_t reaped;
+  do {
+    reaped = _punchRing.reap(wait, tags, results, kReapBatch);
+    wait = false;
+
+    for (size_t i = 0; i < reaped; i++) {
+      const Span span(static_cast<Offset>(tags[i]), static_cast<Length>((tags[i] & ~kPunchToClean) >> 32));
+      if (unlikely(results[i] < 0)) {
+        // e.g. a kernel without IORING_OP_FALLOCATE
+        _punchUnsupported = _punchUnsupported || results[i] == -EINVAL || results[i] == -EOPNOTSUPP;
+        freePhys(ptrFromOffset(span.offset), span.byteLength());
+      }
+      if (tags[i] & kPunchToClean) {
+        _clean[nodeForOffset(span.offset)].add(span);
+      } else {
+        d_assert(_meshPunches > 0);
+        _meshPunches--;
+      }
+    }
+  } while (reaped == kReapBatch);
+
+  if (unlikely(_punchUnsupported) && _punchRing.inFlight() == 0) {
+    _punchRing.reset();
+  }
+}
+
+void MeshableArena::drainPunches() {
+  if (!_punchRing.enabled()) {
+    return;
+  }
+  _punchRing.submit();
+  while (_punchRing.inFlight() > 0) {
+    reapPunches(true);
+  }
+}
+
+void MeshableArena::disableAsyncPunching() {
+  drainPunches();
+  _punchRing.reset();
+}
+
+#if defined(__linux__) && defined(UFFD_FEATURE_WP_HUGETLBFS_SHMEM) && defined(UFFD_USER_MODE_ONLY)
+void MeshableArena::openUserfaultfd() {
+  d_assert(_uffd < 0);
+
+  // user-mode faults only: writes by the kernel to a write-protected
+  // span fail with EFAULT, as they do under mprotect
+  int fd = syscall(__NR_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+  if (fd < 0) {
+    return;
+  }
+
+  struct uffdio_api api {};
+  api.api = UFFD_API;
+  api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP | UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
+  if (ioctl(fd, UFFDIO_API, &api) != 0) {
+    close(fd);
+    return;
+  }
+
+  // write-protecting our arena file's pages needs shmem support
+  // (Linux 5.19), which we can only find out by trying
+  struct uffdio_register reg {};
+  reg.range.start = reinterpret_cast<uintptr_t>(_arenaBegin);
+  reg.range.len = kArenaSize;
+  reg.mode = UFFDIO_REGISTER_MODE_WP;
+  if (ioctl(fd, UFFDIO_REGISTER, &reg) != 0) {
+    close(fd);
+    return;
+  }
+  ioctl(fd, UFFDIO_UNREGISTER, &reg.range);
+
+  _uffd = fd;
+}
+
+bool MeshableArena::writeProtect(void *ptr, size_t sz) {
+  if (_uffd < 0) {
+    return false;
+  }
+
+  // nobody reads faults from _uffd: writers sleep in the kernel until
+  // wakeWriters or writeUnprotect
+  struct uffdio_register reg {};
+  reg.range.start = reinterpret_cast<uintptr_t>(ptr);
+  reg.range.len = sz;
+  reg.mode = UFFDIO_REGISTER_MODE_WP;
+  if (ioctl(_uffd, UFFDIO_REGISTER, &reg) != 0) {
+    return false;
+  }
+
+  struct uffdio_writeprotect wp {};
+  wp.range = reg.range;
+  wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+  if (ioctl(_uffd, UFFDIO_WRITEPROTECT, &wp) != 0) {
+    ioctl(_uffd, UFFDIO_UNREGISTER, &reg.range);
+    return false;
+  }
+
+  return true;
+}
+
+void MeshableArena::writeUnprotect(void *ptr, size_t sz) {
+  d_assert(_uffd >= 0);
+
+  struct uffdio_writeprotect wp {};
+  wp.range.start = reinterpret_cast<uintptr_t>(ptr);
+  wp.range.len = sz;
+  wp.mode = 0;  // also wakes blocked writers
+  int r = ioctl(_uffd, UFFDIO_WRITEPROTECT, &wp);
+  hard_assert(r == 0);
+
+  r = ioctl(_uffd, UFFDIO_UNREGISTER, &wp.range);
   hard_assert(r == 0);
 }
 
-void MeshableArena::finalizeMesh(void *keep, void *remove, size_t sz) {
-  // debug("keep: %p, remove: %p\n", keep, remove);
-  const auto keepOff = offsetFor(keep);
-  const auto removeOff = offsetFor(remove);
+void MeshableArena::wakeWriters(void *ptr, size_t sz) {
+  d_assert(_uffd >= 0);
 
-  const size_t pageCount = sz / kPageSize;
-  const MiniHeapID keepID = _mhIndex[keepOff].load(std::memory_order_acquire);
-  for (size_t i = 0; i < pageCount; i++) {
-    setIndex(removeOff + i, keepID);
+  struct uffdio_range range {};
+  range.start = reinterpret_cast<uintptr_t>(ptr);
+  range.len = sz;
+  int r = ioctl(_uffd, UFFDIO_WAKE, &range);
+  hard_assert(r == 0);
+}
+#else
+void MeshableArena::openUserfaultfd() {
+}
+
+bool MeshableArena::writeProtect(void *ptr, size_t sz) {
+  return false;
+}
+
+void MeshableArena::writeUnprotect(void *ptr, size_t sz) {
+}
+
+void MeshableArena::wakeWriters(void *ptr, size_t sz) {
+}
+#endif
+
+void MeshableArena::disableUserfaultfd() {
+  if (_uffd >= 0) {
+    close(_uffd);
+    _uffd = -1;
   }
+}
 
-  hard_assert(pageCount < std::numeric_limits<Length>::max());
-  const Span removedSpan{removeOff, static_cast<Length>(pageCount)};
-  trackMeshed(removedSpan);
+bool MeshableArena::blockWrites(void *ptr, size_t sz) {
+  if (writeProtect(ptr, sz)) {
+    return true;
+  }
 
-  void *ptr = mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd, keepOff * kPageSize);
-  hard_assert_msg(ptr != MAP_FAILED, "mesh remap failed: %d", errno);
-  freePhys(remove, sz);
+  if (_uffd >= 0 && !_mprotectFallback) {
+    // e.g. out of memory splitting VMAs: writers will fault until we
+    // are done, so make sure they are handled
+    _mprotectFallback = true;
+    runtime().installSegfaultHandler();
+  }
 
-  int r = mprotect(remove, sz, PROT_READ | PROT_WRITE);
+  int r = mprotect(ptr, sz, PROT_READ);
   hard_assert(r == 0);
+  return false;
+}
+
+void MeshableArena::beginMeshes(internal::vector<MeshedSpan> &spans) {
+  std::sort(spans.begin(), spans.end(),
+            [](const MeshedSpan &a, const MeshedSpan &b) { return a.remove < b.remove; });
+
+  for (size_t i = 0; i < spans.size();) {
+    char *start = reinterpret_cast<char *>(spans[i].remove);
+    size_t sz = 0;
+    for (; i < spans.size() && reinterpret_cast<char *>(spans[i].remove) == start + sz; i++) {
+      sz += spans[i].sz;
+    }
+
+    blockWrites(start, sz);
+  }
+}
+
+void MeshableArena::finalizeMeshes(const internal::vector<MeshedSpan> &spans) {
+  for (const auto &span : spans) {
+    // debug("keep: %p, remove: %p\n", span.keep, span.remove);
+    const auto keepOff = offsetFor(span.keep);
+    const auto removeOff = offsetFor(span.remove);
+
+    const size_t pageCount = span.sz / kPageSize;
+    const MiniHeapID keepID = _pageMap.get(keepOff);
+    for (size_t i = 0; i < pageCount; i++) {
+      setIndex(removeOff + i, keepID);
+    }
+
+    hard_assert(pageCount < std::numeric_limits<Length>::max());
+    const Span removedSpan{removeOff, static_cast<Length>(pageCount)};
+    trackMeshed(removedSpan);
+  }
+
+  // the new mapping is read/write (and not write-protected), so this
+  // also undoes beginMeshes.  Spans next to each other whose keep
+  // spans are too (in the same order) are remapped at once.
+  for (size_t i = 0; i < spans.size();) {
+    char *remove = reinterpret_cast<char *>(spans[i].remove);
+    char *keep = reinterpret_cast<char *>(spans[i].keep);
+    size_t sz = 0;
+    for (; i < spans.size() && reinterpret_cast<char *>(spans[i].remove) == remove + sz &&
+           reinterpret_cast<char *>(spans[i].keep) == keep + sz;
+         i++) {
+      sz += spans[i].sz;
+    }
+
+    void *ptr = mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd, offsetFor(keep) * kPageSize);
+    hard_assert_msg(ptr != MAP_FAILED, "mesh remap failed: %d", errno);
+
+    // writers blocked on these spans can retry against the new mapping
+    if (_uffd >= 0) {
+      wakeWriters(remove, sz);
+    }
+  }
+
+  for (size_t i = 0; i < spans.size();) {
+    char *start = reinterpret_cast<char *>(spans[i].remove);
+    size_t sz = 0;
+    for (; i < spans.size() && reinterpret_cast<char *>(spans[i].remove) == start + sz; i++) {
+      sz += spans[i].sz;
+    }
+
+    punchSpan(Span(offsetFor(start), sz / kPageSize), false);
+  }
+  submitPunches();
 }
 
 int MeshableArena::openShmSpanFile(size_t sz) {
@@ -476,10 +940,13 @@ int MeshableArena::openShmSpanFile(size_t sz) {
   char buf[buf_len];
   memset(buf, 0, buf_len);
 
-  _spanDir = openSpanDir(getpid());
-  d_assert(_spanDir != nullptr);
+  char *spanDir = openSpanDir(getpid());
+  if (spanDir == nullptr) {
+    debug("mesh: no directory to create the arena file in\n");
+    abort();
+  }
 
-  sprintf(buf, "%s/XXXXXX", _spanDir);
+  sprintf(buf, "%s/XXXXXX", spanDir);
 
   int fd = mkstemp(buf);
   if (fd < 0) {
@@ -487,12 +954,15 @@ int MeshableArena::openShmSpanFile(size_t sz) {
     abort();
   }
 
-  // we only need the file descriptors, not the path to the file in the FS
+  // we only need the file descriptors, not the path to the file in
+  // the FS -- nor its directory, so nothing is left behind if we crash
   int err = unlink(buf);
   if (err != 0) {
     debug("unlink: %d\n", errno);
     abort();
   }
+  rmdir(spanDir);
+  internal::Heap().free(spanDir);
 
   // TODO: see if fallocate makes any difference in performance
   err = ftruncate(fd, sz);
@@ -511,14 +981,14 @@ int MeshableArena::openShmSpanFile(size_t sz) {
   return fd;
 }
 
-#ifdef USE_MEMFD
+#if defined(USE_MEMFD) && defined(__NR_memfd_create)
 static int sys_memfd_create(const char *name, unsigned int flags) {
   return syscall(__NR_memfd_create, name, flags);
 }
 
 int MeshableArena::openSpanFile(size_t sz) {
   errno = 0;
-  int fd = sys_memfd_create("mesh_arena", MFD_CLOEXEC);
+  int fd = sys_memfd_create("mesh_arena", MFD_CLOEXEC | (kSealArenaFile ? MFD_ALLOW_SEALING : 0));
   // the call to memfd failed -- fall back to opening a shm file
   if (fd < 0) {
     return openShmSpanFile(sz);
@@ -530,6 +1000,14 @@ int MeshableArena::openSpanFile(size_t sz) {
     abort();
   }
 
+#ifdef F_ADD_SEALS
+  // nothing else holding the fd can resize the arena out from under
+  // us.  Punching holes is still allowed.
+  if (kSealArenaFile && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+    debug("mesh: sealing the arena file failed: %d\n", errno);
+  }
+#endif
+
   return fd;
 }
 #else
@@ -538,12 +1016,6 @@ int MeshableArena::openSpanFile(size_t sz) {
 }
 #endif  // USE_MEMFD
 
-void MeshableArena::staticAtExit() {
-  d_assert(arenaInstance != nullptr);
-  if (arenaInstance != nullptr)
-    reinterpret_cast<MeshableArena *>(arenaInstance)->exit();
-}
-
 void MeshableArena::staticPrepareForFork() {
   d_assert(arenaInstance != nullptr);
   reinterpret_cast<MeshableArena *>(arenaInstance)->prepareForFork();
@@ -565,11 +1037,18 @@ void MeshableArena::prepareForFork() {
   }
 
   // debug("%d: prepare fork", getpid());
+  if (kPerCPUHeaps) {
+    CPULocalHeaps::lock();
+  }
   runtime().heap().lock();
   runtime().lock();
 
-  int r = mprotect(_arenaBegin, kArenaSize, PROT_READ);
-  hard_assert(r == 0);
+  // the child copies our file: no punch may land halfway through
+  drainPunches();
+
+  // the huge page region is private, so fork copies it for us
+  _forkWriteProtected = true;
+  forEachFileRange([&](void *ptr, size_t sz) { _forkWriteProtected &= blockWrites(ptr, sz); });
 
   int err = pipe(_forkPipe);
   if (err == -1) {
@@ -601,12 +1080,21 @@ void MeshableArena::afterForkParent() {
 
   // only after the child has finished copying the heap is it safe to
   // go back to read/write
-  int r = mprotect(_arenaBegin, kArenaSize, PROT_READ | PROT_WRITE);
-  hard_assert(r == 0);
+  forEachFileRange([&](void *ptr, size_t sz) {
+    if (_forkWriteProtected) {
+      writeUnprotect(ptr, sz);
+    } else {
+      int r = mprotect(ptr, sz, PROT_READ | PROT_WRITE);
+      hard_assert(r == 0);
+    }
+  });
 
   // debug("%d: after fork parent", getpid());
   runtime().unlock();
   runtime().heap().unlock();
+  if (kPerCPUHeaps) {
+    CPULocalHeaps::unlock();
+  }
 }
 
 void MeshableArena::doAfterForkChild() {
@@ -628,33 +1116,72 @@ void MeshableArena::afterForkChild() {
   // debug("%d: after fork child", getpid());
   runtime().unlock();
   runtime().heap().unlock();
+  if (kPerCPUHeaps) {
+    CPULocalHeaps::unlock();
+  }
+  runtime().heap().stopBackgroundMeshing();
 
   close(_forkPipe[0]);
 
-  char *oldSpanDir = _spanDir;
-
   // open new file for the arena
-  int newFd = openSpanFile(kArenaSize);
+  int newFd = openSpanFile(kMaxArenaSize);
 
   struct stat fileinfo;
   memset(&fileinfo, 0, sizeof(fileinfo));
   fstat(newFd, &fileinfo);
-  d_assert(fileinfo.st_size >= 0 && (size_t)fileinfo.st_size == kArenaSize);
+  d_assert(fileinfo.st_size >= 0 && (size_t)fileinfo.st_size == kMaxArenaSize);
 
   const int oldFd = _fd;
 
-  const auto bitmap = allocatedBitmap();
-  for (auto const &i : bitmap) {
-    int result = internal::copyFile(newFd, oldFd, i * kPageSize, kPageSize);
-    d_assert(result == CPUInfo::PageSize);
+  if (_end > 0) {
+    // copy runs of allocated pages at once.  Free pages don't need
+    // copying, and a meshed-away span's own pages were punched out:
+    // it is remapped onto its keep span below.  The huge page region
+    // below the second segment isn't in the file at all.
+    const auto bitmap = allocatedBitmap();
+    Offset runStart = 0;
+    size_t runLength = 0;
+    auto copyRun = [&]() {
+      if (runLength == 0) {
+        return;
+      }
+      const size_t sz = runLength * kPageSize;
+      const auto result = internal::copyFile(newFd, oldFd, runStart * kPageSize, sz);
+      hard_assert_msg(result == static_cast<ssize_t>(sz), "fork copy failed: %d", errno);
+      runLength = 0;
+    };
+    for (auto const &i : bitmap) {
+      if (_meshedBitmap.isSet(i) || inHugePageArena(i)) {
+        continue;
+      }
+      if (runLength > 0 && i != runStart + runLength) {
+        copyRun();
+      }
+      if (runLength == 0) {
+        runStart = i;
+      }
+      runLength++;
+    }
+    copyRun();
   }
 
-  int r = mprotect(_arenaBegin, kArenaSize, PROT_READ | PROT_WRITE);
-  hard_assert(r == 0);
-
   // remap the new region over the old
-  void *ptr = mmap(_arenaBegin, kArenaSize, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, newFd, 0);
-  hard_assert_msg(ptr != MAP_FAILED, "map failed: %d", errno);
+  forEachFileRange([&](void *range, size_t sz) {
+    int r = mprotect(range, sz, PROT_READ | PROT_WRITE);
+    hard_assert(r == 0);
+
+    const off_t fileOff = reinterpret_cast<char *>(range) - reinterpret_cast<char *>(_arenaBegin);
+    void *ptr = mmap(range, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, newFd, fileOff);
+    hard_assert_msg(ptr != MAP_FAILED, "map failed: %d", errno);
+  });
+
+  // node placement is a policy of the old file's pages
+  for (Offset off = 0; off < _end; off += kMinArenaExpansion) {
+    if (inHugePageArena(off)) {
+      continue;
+    }
+    numa::bind(ptrFromOffset(off), kMinArenaExpansion * kPageSize, nodeForOffset(off));
+  }
 
   // re-do the meshed mappings
   {
@@ -662,6 +1189,10 @@ void MeshableArena::afterForkChild() {
 
     for (auto const &i : _meshedBitmap) {
       MiniHeap *mh = reinterpret_cast<MiniHeap *>(miniheapForArenaOffset(i));
+      // freed, waiting in _toReset: the new identity mapping will do
+      if (mh == nullptr) {
+        continue;
+      }
       if (seenMiniheaps.find(mh) != seenMiniheaps.end()) {
         continue;
       }
@@ -685,11 +1216,11 @@ void MeshableArena::afterForkChild() {
 #ifndef NDEBUG
         const Length pageCount = sz / kPageSize;
         for (size_t i = 0; i < pageCount; i++) {
-          d_assert(_mhIndex[removeOff + i].load().value() == _mhIndex[keepOff].load().value());
+          d_assert(_pageMap.get(removeOff + i) == _pageMap.get(keepOff));
         }
 #endif
 
-        void *ptr = mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd, keepOff * kPageSize);
+        void *ptr = mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, newFd, keepOff * kPageSize);
 
         hard_assert_msg(ptr != MAP_FAILED, "mesh remap failed: %d", errno);
 
@@ -700,10 +1231,23 @@ void MeshableArena::afterForkChild() {
 
   _fd = newFd;
 
-  internal::Heap().free(oldSpanDir);
-
   close(oldFd);
 
+  // as does our io_uring, drained before the fork
+  if (_punchRing.enabled()) {
+    _punchRing.reset();
+    _punchRing.init();
+  }
+
+  // our userfaultfd belongs to the parent's address space
+  if (_uffd >= 0) {
+    disableUserfaultfd();
+    openUserfaultfd();
+    if (_uffd < 0) {
+      runtime().installSegfaultHandler();
+    }
+  }
+
   while (write(_forkPipe[1], "ok", strlen("ok")) == EAGAIN) {
   }
   close(_forkPipe[1]);
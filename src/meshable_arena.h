@@ -26,6 +26,7 @@
 #include <sys/sendfile.h>
 #endif
 
+#include <limits>
 #include <new>
 
 #include "internal.h"
@@ -36,6 +37,11 @@
 
 #include "mmap_heap.h"
 
+#include "free_span_map.h"
+#include "numa.h"
+#include "page_map.h"
+#include "punch_ring.h"
+
 #ifndef MADV_DONTDUMP
 #define MADV_DONTDUMP 0
 #endif
@@ -54,18 +60,35 @@ private:
 public:
   enum { Alignment = kPageSize };
 
+  static constexpr Offset kSegmentPages = kArenaSize / kPageSize;
+
+  static_assert(kMaxArenaSize / kPageSize <= std::numeric_limits<Offset>::max(), "arena pages must fit an Offset");
+  static_assert(kSegmentPages % kMinArenaExpansion == 0, "segments must hold whole expansion chunks");
+
   explicit MeshableArena();
 
+  // true for the whole reservation: pages of segments not mapped yet
+  // are simply not indexed
   inline bool contains(const void *ptr) const {
     auto arena = reinterpret_cast<uintptr_t>(_arenaBegin);
     auto ptrval = reinterpret_cast<uintptr_t>(ptr);
-    return arena <= ptrval && ptrval < arena + kArenaSize;
+    return arena <= ptrval && ptrval < arena + kMaxArenaSize;
   }
 
-  char *pageAlloc(Span &result, size_t pageCount, size_t pageAlignment = 1);
+  // type is set to Clean if every page in the returned span is
+  // known to be zero (never touched, or scavenged), and Dirty
+  // otherwise.  With hugePages, the span comes from the huge page
+  // region if it is enabled and has room.
+  char *pageAlloc(Span &result, size_t pageCount, size_t pageAlignment, internal::PageType &type,
+                  bool hugePages = false);
 
   void free(void *ptr, size_t sz, internal::PageType type);
 
+  // try to grow the allocated span by extraPages, using the free
+  // pages immediately following it.  On success span covers the
+  // extended range, and the new pages are still unindexed.
+  bool extendInPlace(Span &span, size_t extraPages);
+
   inline void trackMiniHeap(const Span span, MiniHeapID id) {
     // now that we know they are available, set the empty pages to
     // in-use.  This is safe because this whole function is called
@@ -73,7 +96,7 @@ public:
     // modification between the loop above and the one below.
     for (size_t i = 0; i < span.length; i++) {
 #ifndef NDEBUG
-      d_assert(!_mhIndex[span.offset + i].load(std::memory_order_acquire).hasValue());
+      d_assert(!_pageMap.get(span.offset + i).hasValue());
       // auto mh = reinterpret_cast<MiniHeap *>(miniheapForArenaOffset(span.offset + i));
       // mh->dumpDebug();
 #endif
@@ -81,13 +104,24 @@ public:
     }
   }
 
-  inline void *ATTRIBUTE_ALWAYS_INLINE miniheapForArenaOffset(Offset arenaOff) const {
-    const MiniHeapID mhOff = _mhIndex[arenaOff].load(std::memory_order_acquire);
-    d_assert(mhOff.hasValue());
-    const auto result = _mhAllocator.ptrFromOffset(mhOff.value());
-    // debug("lookup ok for (%zu) %zu %p\n", arenaOff, mhOff, result);
+  // point already-indexed pages at a new miniheap
+  inline void retrackMiniHeap(const Span span, MiniHeapID id) {
+    for (size_t i = 0; i < span.length; i++) {
+      setIndex(span.offset + i, id);
+    }
+  }
+
+  inline void *ATTRIBUTE_ALWAYS_INLINE indexedMiniheap(MiniHeapID mhOff) const {
+    // frees don't hold a lock that keeps the span indexed, so a racing
+    // free of its last object may have just untracked it
+    if (unlikely(!mhOff.hasValue())) {
+      return nullptr;
+    }
+    return _mhAllocator.ptrFromOffset(mhOff.value());
+  }
 
-    return result;
+  inline void *ATTRIBUTE_ALWAYS_INLINE miniheapForArenaOffset(Offset arenaOff) const {
+    return indexedMiniheap(_pageMap.get(arenaOff));
   }
 
   inline void *ATTRIBUTE_ALWAYS_INLINE lookupMiniheap(const void *ptr) const {
@@ -101,8 +135,85 @@ public:
     return miniheapForArenaOffset(arenaOff);
   }
 
-  void beginMesh(void *keep, void *remove, size_t sz);
-  void finalizeMesh(void *keep, void *remove, size_t sz);
+  // lookupMiniheap, through a thread's cache of its last page map leaf
+  inline void *ATTRIBUTE_ALWAYS_INLINE lookupMiniheap(const void *ptr, PageMap::Cache &cache) const {
+    if (unlikely(!contains(ptr))) {
+      return nullptr;
+    }
+
+    return indexedMiniheap(_pageMap.get(offsetFor(ptr), cache));
+  }
+
+  // a span whose objects are being meshed into keep's
+  struct MeshedSpan {
+    void *keep;
+    void *remove;
+    size_t sz;
+  };
+
+  // meshing a batch of spans: beginMeshes marks every span to remove
+  // read-only and finalizeMeshes remaps them onto their keep span and
+  // frees their physical memory.  spans is sorted by remove, so that
+  // adjacent spans share a syscall.
+  void beginMeshes(internal::vector<MeshedSpan> &spans);
+  void finalizeMeshes(const internal::vector<MeshedSpan> &spans);
+
+  // when the kernel supports userfaultfd write-protection of our
+  // arena, writes to spans being meshed (or to the whole arena during
+  // fork) block in the kernel instead of faulting into
+  // Runtime::segfaultHandler, and each writer is released as soon as
+  // its span has been remapped.
+  inline bool usesUserfaultfd() const {
+    return _uffd >= 0;
+  }
+
+  // true once writes may have to be trapped with mprotect
+  inline bool needsSegfaultHandler() const {
+    return _uffd < 0 || _mprotectFallback;
+  }
+
+  // use mprotect from now on -- must be called before any meshing
+  void disableUserfaultfd();
+
+  // hole punches are queued on an io_uring in batches where the
+  // kernel supports it, and the pages they free only reused once
+  // they complete
+  inline bool usesAsyncPunching() const {
+    return _punchRing.enabled();
+  }
+
+  // punch holes synchronously from now on.  Caller must hold the
+  // arena lock.
+  void disableAsyncPunching();
+
+  // back the top kHugePageArenaSize of the first segment with private
+  // anonymous memory that the kernel may back with transparent huge
+  // pages.  Spans there are never meshed, nor shared with a forked
+  // child's arena file (fork copies them like any private mapping).
+  // Fails if the file-backed arena has already grown into that range;
+  // once enabled, the file-backed arena skips over it to the second
+  // segment.
+  bool enableHugePages();
+
+  inline bool hugePagesEnabled() const {
+    return _hugeBegin != 0;
+  }
+
+  inline bool inHugePageArena(Offset off) const {
+    return _hugeBegin != 0 && off >= _hugeBegin && off < kSegmentPages;
+  }
+
+  // segments of the arena mapped so far
+  inline size_t segmentCount() const {
+    return _segmentCount;
+  }
+
+  // the memory node pages at off are placed on.  The file-backed
+  // arena grows in kMinArenaExpansion chunks, each bound to the node
+  // of the thread that needed it.
+  inline uint32_t nodeForOffset(Offset off) const {
+    return _chunkNode[off / kMinArenaExpansion];
+  }
 
   inline bool aboveMeshThreshold() const {
     return _meshedPageCount > _maxMeshCount;
@@ -123,6 +234,30 @@ public:
   // like a scavenge, but we only MADV_FREE
   void partialScavenge();
 
+  // with dirty page decay on, freeing pages never returns them to the
+  // OS on the freeing thread, and a non-forced scavenge leaves them
+  // dirty: decayScavenge, run by the mesher thread, releases them once
+  // they have gone unused for kDirtyDecaySteps epochs.
+  void setDirtyDecay(bool enabled) {
+    _dirtyDecay = enabled;
+    _purgeRequested = false;
+  }
+  inline bool dirtyDecay() const {
+    return _dirtyDecay;
+  }
+  // start a new decay epoch, and release the dirty spans last freed
+  // kDirtyDecaySteps or more epochs ago -- or every dirty span if
+  // more than kMaxDirtyPageThreshold pages had piled up
+  void decayScavenge();
+  // true once the dirty pages pass kMaxDirtyPageThreshold with decay
+  // on, until the next decayScavenge
+  inline bool purgeRequested() const {
+    return _purgeRequested;
+  }
+  inline size_t dirtyPageCount() const {
+    return _dirtyPageCount;
+  }
+
   // return the maximum number of pages we've had meshed (and thus our
   // savings) at any point in time.
   inline size_t meshedPageHighWaterMark() const {
@@ -137,31 +272,59 @@ public:
     return reinterpret_cast<char *>(_arenaBegin);
   }
   void *arenaEnd() const {
-    return reinterpret_cast<char *>(_arenaBegin) + kArenaSize;
+    return reinterpret_cast<char *>(_arenaBegin) + kMaxArenaSize;
   }
 
   void doAfterForkChild();
 
 private:
-  void expandArena(size_t minPagesAdded);
-  bool findPages(size_t pageCount, Span &result, internal::PageType &type);
-  bool ATTRIBUTE_NEVER_INLINE findPagesInner(internal::vector<Span> freeSpans[kSpanClassCount], size_t i,
-                                             size_t pageCount, Span &result);
-  Span reservePages(size_t pageCount, size_t pageAlignment);
+  void expandArena(size_t minPagesAdded, uint32_t node);
+  // hand span, at the old end of the arena, out to node
+  void addExpansion(const Span &span, uint32_t node);
+  // map the next segment to the arena file
+  void mapSegment();
+  // call func(ptr, size) for each mapped, file-backed range of the
+  // arena: at most two, as the huge page region sits between the
+  // first segment's file-backed pages and the second segment
+  template <typename Func>
+  void forEachFileRange(const Func &func) const {
+    if (_hugeBegin == 0) {
+      func(_arenaBegin, _segmentCount * kArenaSize);
+      return;
+    }
+    func(_arenaBegin, static_cast<size_t>(_hugeBegin) * kPageSize);
+    if (_segmentCount > 1) {
+      func(ptrFromOffset(kSegmentPages), (_segmentCount - 1) * kArenaSize);
+    }
+  }
+  bool findPages(size_t pageCount, uint32_t node, Span &result, internal::PageType &type);
+  Span reservePages(size_t pageCount, size_t pageAlignment, uint32_t node, internal::PageType &type);
   void freePhys(void *ptr, size_t sz);
+  // punch span's pages out of the arena file, putting it on the clean
+  // list afterwards if toClean is set.  With io_uring this happens
+  // when reapPunches sees the punch complete, and it is only submitted
+  // by submitPunches.
+  void punchSpan(const Span &span, bool toClean);
+  void submitPunches();
+  // handle completed punches, first waiting for one if wait is set
+  void reapPunches(bool wait);
+  // wait for every punch in flight to complete
+  void drainPunches();
   internal::RelaxedBitmap allocatedBitmap(bool includeDirty = true) const;
 
   void *malloc(size_t sz) = delete;
+  bool hugePageAlloc(Span &result, size_t pageCount, size_t pageAlignment, internal::PageType &type);
+  void hugePageFree(const Span &span, internal::PageType type);
+  bool takeFollowingHugePages(Offset offset, size_t pageCount);
+  // returns the number of pages released
+  size_t hugePageScavenge(uint32_t minAge = 0);
+  // release the dirty spans last freed at least minAge decay epochs ago
+  void releaseDirty(uint32_t minAge);
 
   inline bool isAligned(const Span &span, const size_t pageAlignment) const {
     return ptrvalFromOffset(span.offset) % (pageAlignment * kPageSize) == 0;
   }
 
-  static constexpr size_t indexSize() {
-    // one pointer per page in our arena
-    return sizeof(Offset) * (kArenaSize / kPageSize);
-  }
-
   inline void clearIndex(const Span &span) {
     for (size_t i = 0; i < span.length; i++) {
       // clear the miniheap pointers we were tracking
@@ -176,8 +339,9 @@ private:
 
     // this happens when we are trying to get an aligned allocation
     // and returning excess back to the arena
+    const auto node = nodeForOffset(span.offset);
     if (flags == internal::PageType::Clean) {
-      _clean[span.spanClass()].push_back(span);
+      _clean[node].add(span);
       return;
     }
 
@@ -188,12 +352,15 @@ private:
         madvise(ptrFromOffset(span.offset), span.length * kPageSize, MADV_DONTDUMP);
       }
       d_assert(span.length > 0);
-      _dirty[span.spanClass()].push_back(span);
+      _dirty[node].add(span, _decayEpoch);
       _dirtyPageCount += span.length;
 
       if (_dirtyPageCount > kMaxDirtyPageThreshold) {
-        // do a full scavenge with a probability 1/10
-        if (_fastPrng.inRange(0, 9) == 9) {
+        if (_dirtyDecay) {
+          // leave it to the mesher thread
+          _purgeRequested = true;
+        } else if (_fastPrng.inRange(0, 9) == 9) {
+          // do a full scavenge with a probability 1/10
           scavenge(true);
         } else {
           partialScavenge();
@@ -228,29 +395,19 @@ private:
   }
 
   inline void setIndex(size_t off, MiniHeapID val) {
-    d_assert(off < indexSize());
-    _mhIndex[off].store(val, std::memory_order_release);
+    d_assert(off < _segmentCount * kSegmentPages);
+    _pageMap.set(off, val);
   }
 
-  static void staticAtExit();
   static void staticPrepareForFork();
   static void staticAfterForkParent();
   static void staticAfterForkChild();
 
-  void exit() {
-    // FIXME: do this from the destructor, and test that destructor is
-    // called.  Also don't leak _spanDir
-    if (_spanDir != nullptr) {
-      rmdir(_spanDir);
-      _spanDir = nullptr;
-    }
-  }
-
   inline void trackMeshed(const Span &span) {
     for (size_t i = 0; i < span.length; i++) {
       // this may already be 1 if it was a meshed virtual span that is
       // now being re-meshed to a new owning miniheap
-      _meshedBitmap.tryToSet(span.offset + i);
+      _meshedPageCount += _meshedBitmap.tryToSet(span.offset + i);
     }
   }
 
@@ -259,6 +416,7 @@ private:
       d_assert(_meshedBitmap.isSet(span.offset + i));
       _meshedBitmap.unset(span.offset + i);
     }
+    _meshedPageCount -= span.length;
   }
 
   inline void resetSpanMapping(const Span &span) {
@@ -273,35 +431,77 @@ private:
 
   void *_arenaBegin{nullptr};
   // indexed by page offset.
-  atomic<MiniHeapID> *_mhIndex{nullptr};
+  PageMap _pageMap{};
 
 protected:
-  CheapHeap<64, kArenaSize / kPageSize> _mhAllocator{};
+  CheapHeap<64, kMaxArenaSize / kPageSize> _mhAllocator{};
   MWC _fastPrng;
 
 private:
   Offset _end{};  // in pages
+  size_t _segmentCount{0};
+
+  // the huge page region is [_hugeBegin, kSegmentPages), 0
+  // if not enabled.  It is bump-allocated up to _hugeEnd, and its
+  // free spans are kept sorted by offset, with neighbours coalesced
+  // unless only one of them is dirty.
+  struct HugeFreeSpan {
+    HugeFreeSpan(Span span_, bool dirty_, uint32_t epoch_ = 0) : span(span_), dirty(dirty_), epoch(epoch_) {
+    }
+
+    Span span;
+    bool dirty;
+    // the decay epoch it was last freed in, if dirty
+    uint32_t epoch;
+  };
+  Offset _hugeBegin{0};
+  Offset _hugeEnd{0};
+  internal::vector<HugeFreeSpan> _hugeFree{};
 
   // spans that had been meshed, have been freed, and need to be reset
   // to identity mappings in the page tables.
   internal::vector<Span> _toReset;
 
-  internal::vector<Span> _clean[kSpanClassCount];
-  internal::vector<Span> _dirty[kSpanClassCount];
+  // free spans, per memory node.  A free span never crosses from one
+  // node's chunk into another's.
+  FreeSpanMap _clean[kMaxNumaNodes];
+  FreeSpanMap _dirty[kMaxNumaNodes];
+  uint8_t _chunkNode[kMaxArenaSize / kPageSize / kMinArenaExpansion]{};
 
   size_t _dirtyPageCount{0};
+  uint32_t _decayEpoch{0};
+  bool _dirtyDecay{false};
+  bool _purgeRequested{false};
 
   internal::RelaxedBitmap _meshedBitmap{
-      kArenaSize / kPageSize,
-      reinterpret_cast<char *>(OneWayMmapHeap().malloc(bitmap::representationSize(kArenaSize / kPageSize))), false};
+      kMaxArenaSize / kPageSize,
+      reinterpret_cast<char *>(OneWayMmapHeap().malloc(bitmap::representationSize(kMaxArenaSize / kPageSize))),
+      false};
   size_t _meshedPageCount{0};
   size_t _meshedPageCountHWM{0};
   size_t _rssKbAtHWM{0};
   size_t _maxMeshCount{kDefaultMaxMeshCount};
 
+  // userfaultfd write-protection, see usesUserfaultfd.  writeProtect
+  // returns false if [ptr, ptr+sz) couldn't be write-protected;
+  // blockWrites then falls back to mprotect, returning false.
+  void openUserfaultfd();
+  bool writeProtect(void *ptr, size_t sz);
+  void writeUnprotect(void *ptr, size_t sz);
+  void wakeWriters(void *ptr, size_t sz);
+  bool blockWrites(void *ptr, size_t sz);
+
   int _fd;
+  PunchRing _punchRing{};
+  // punches of meshed-away spans in flight: their spans can't be reset
+  // to an identity mapping (and reused) until these complete
+  size_t _meshPunches{0};
+  // io_uring can't punch holes on this kernel; stop when drained
+  bool _punchUnsupported{false};
+  int _uffd{-1};
+  bool _mprotectFallback{false};
+  bool _forkWriteProtected{false};
   int _forkPipe[2]{-1, -1};  // used for signaling during fork
-  char *_spanDir{nullptr};
 };
 }  // namespace mesh
 
@@ -19,6 +19,12 @@
 #include "binned_tracker.h"
 #include "bitmap.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 namespace mesh {
 
 using internal::Bitmap;
@@ -43,13 +49,170 @@ inline bool bitmapsMeshable(const Bitmap::word_t *__restrict__ bitmap1, const Bi
   return true;
 }
 
+// a MiniHeap's occupancy bitmap, copied out of the MiniHeap so that
+// shiftedSplitting can scan candidates laid out back to back instead
+// of chasing a MiniHeap pointer per comparison
+struct PackedBitmap {
+  static constexpr size_t kWords = 4;  // 256 bits, kMaxShuffleVectorLength objects
+
+  uint64_t bits[kWords];
+
+  inline void copyFrom(const Bitmap::word_t *src) {
+    for (size_t i = 0; i < kWords; i++) {
+      bits[i] = src[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  inline void orWith(const PackedBitmap &other) {
+    for (size_t i = 0; i < kWords; i++) {
+      bits[i] |= other.bits[i];
+    }
+  }
+
+  inline bool disjointWith(const PackedBitmap &other) const {
+    uint64_t overlap = 0;
+    for (size_t i = 0; i < kWords; i++) {
+      overlap |= bits[i] & other.bits[i];
+    }
+    return overlap == 0;
+  }
+
+  // never meshable with a non-empty bitmap
+  inline void setAll() {
+    for (size_t i = 0; i < kWords; i++) {
+      bits[i] = ~static_cast<uint64_t>(0);
+    }
+  }
+};
+static_assert(sizeof(PackedBitmap) == 32, "PackedBitmap should be 32 bytes");
+
+// meshableMask(bitmap, candidates, count) returns a mask with bit i
+// set if bitmap is meshable with candidates[i], for count <= 64
+// candidates.  The vector variants are selected once at runtime.
+namespace kernel {
+static constexpr size_t kMaxMaskCandidates = 64;
+
+inline uint64_t meshableMaskScalar(const PackedBitmap &bitmap, const PackedBitmap *candidates, size_t count) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t overlap = 0;
+    for (size_t j = 0; j < PackedBitmap::kWords; j++) {
+      overlap |= bitmap.bits[j] & candidates[i].bits[j];
+    }
+    mask |= static_cast<uint64_t>(overlap == 0) << i;
+  }
+  return mask;
+}
+
+#if defined(__x86_64__)
+inline uint64_t meshableMaskSSE2(const PackedBitmap &bitmap, const PackedBitmap *candidates, size_t count) {
+  const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&bitmap.bits[0]));
+  const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&bitmap.bits[2]));
+  const __m128i zero = _mm_setzero_si128();
+
+  uint64_t mask = 0;
+  for (size_t i = 0; i < count; i++) {
+    const auto c = reinterpret_cast<const __m128i *>(candidates[i].bits);
+    const __m128i overlap =
+        _mm_or_si128(_mm_and_si128(lo, _mm_loadu_si128(c)), _mm_and_si128(hi, _mm_loadu_si128(c + 1)));
+    const bool meshable = _mm_movemask_epi8(_mm_cmpeq_epi8(overlap, zero)) == 0xffff;
+    mask |= static_cast<uint64_t>(meshable) << i;
+  }
+  return mask;
+}
+
+__attribute__((target("avx"))) inline uint64_t meshableMaskAVX(const PackedBitmap &bitmap,
+                                                               const PackedBitmap *candidates, size_t count) {
+  const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bitmap.bits));
+
+  uint64_t mask = 0;
+  for (size_t i = 0; i < count; i++) {
+    const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(candidates[i].bits));
+    mask |= static_cast<uint64_t>(_mm256_testz_si256(b, c)) << i;
+  }
+  return mask;
+}
+
+// two candidates per 512-bit register: each yields a nibble of the
+// per-word test mask, which is zero if the pair is meshable
+__attribute__((target("avx512f"))) inline uint64_t meshableMaskAVX512(const PackedBitmap &bitmap,
+                                                                     const PackedBitmap *candidates, size_t count) {
+  const __m512i b = _mm512_broadcast_i64x4(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(bitmap.bits)));
+
+  uint64_t mask = 0;
+  size_t i = 0;
+  for (; i + 1 < count; i += 2) {
+    const __m512i c = _mm512_loadu_si512(candidates[i].bits);
+    const unsigned overlap = _mm512_test_epi64_mask(b, c);
+    mask |= static_cast<uint64_t>((overlap & 0xf) == 0) << i;
+    mask |= static_cast<uint64_t>((overlap & 0xf0) == 0) << (i + 1);
+  }
+  if (i < count) {
+    mask |= meshableMaskScalar(bitmap, &candidates[i], 1) << i;
+  }
+  return mask;
+}
+#elif defined(__aarch64__)
+inline uint64_t meshableMaskNEON(const PackedBitmap &bitmap, const PackedBitmap *candidates, size_t count) {
+  const uint64x2_t lo = vld1q_u64(&bitmap.bits[0]);
+  const uint64x2_t hi = vld1q_u64(&bitmap.bits[2]);
+
+  uint64_t mask = 0;
+  for (size_t i = 0; i < count; i++) {
+    const uint64x2_t overlap = vorrq_u64(vandq_u64(lo, vld1q_u64(&candidates[i].bits[0])),
+                                         vandq_u64(hi, vld1q_u64(&candidates[i].bits[2])));
+    const bool meshable = vmaxvq_u32(vreinterpretq_u32_u64(overlap)) == 0;
+    mask |= static_cast<uint64_t>(meshable) << i;
+  }
+  return mask;
+}
+#endif
+
+typedef uint64_t (*MeshableMaskFn)(const PackedBitmap &, const PackedBitmap *, size_t);
+
+inline MeshableMaskFn selectMeshableMask() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return meshableMaskAVX512;
+  }
+  if (__builtin_cpu_supports("avx")) {
+    return meshableMaskAVX;
+  }
+  return meshableMaskSSE2;
+#elif defined(__aarch64__)
+  return meshableMaskNEON;
+#else
+  return meshableMaskScalar;
+#endif
+}
+}  // namespace kernel
+
+inline uint64_t meshableMask(const PackedBitmap &bitmap, const PackedBitmap *candidates, size_t count) {
+  d_assert(count <= kernel::kMaxMaskCandidates);
+  static const kernel::MeshableMaskFn impl = kernel::selectMeshableMask();
+  return impl(bitmap, candidates, count);
+}
+
+// buffers a size class's mesh passes reuse (see
+// GlobalHeap::meshSizeClass), so that once they have grown, gathering
+// candidates and pairing them up doesn't allocate
+struct MeshScratch {
+  internal::vector<MiniHeap *> candidates{};
+  // the candidates on one memory node, when there are several
+  internal::vector<MiniHeap *> nodeCandidates{};
+  internal::vector<MiniHeap *> left{};
+  internal::vector<MiniHeap *> right{};
+  internal::vector<PackedBitmap> bitmaps{};
+  internal::vector<std::pair<MiniHeap *, MiniHeap *>> pairs{};
+  internal::vector<std::pair<MiniHeap *, MiniHeap *>> batch{};
+};
+
 namespace method {
 
-// split miniheaps into two lists in a random order
-inline void halfSplit(MWC &prng, BinnedTracker &miniheaps, internal::vector<MiniHeap *> &left,
+// split the candidates in bucket into two lists in a random order
+inline void halfSplit(MWC &prng, internal::vector<MiniHeap *> &bucket, internal::vector<MiniHeap *> &left,
                       internal::vector<MiniHeap *> &right) noexcept {
-  internal::vector<MiniHeap *> bucket = miniheaps.meshingCandidates(kOccupancyCutoff);
-
   internal::mwcShuffle(bucket.begin(), bucket.end(), prng);
 
   for (size_t i = 0; i < bucket.size(); i++) {
@@ -64,16 +227,24 @@ inline void halfSplit(MWC &prng, BinnedTracker &miniheaps, internal::vector<Mini
   }
 }
 
+// candidates is a snapshot of a size class's meshing candidates (see
+// BinnedTracker::meshingCandidates).  Only their bitmaps are read, so
+// this can run without the size class lock -- pairs passed to
+// meshFound must be re-validated before meshing.
 template <size_t t = 64>
-inline void shiftedSplitting(MWC &prng, BinnedTracker &miniheaps,
+inline void shiftedSplitting(MWC &prng, internal::vector<MiniHeap *> &candidates, MeshScratch &scratch,
                              const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound) noexcept {
-  if (miniheaps.partialSize() == 0)
+  static_assert(t <= kernel::kMaxMaskCandidates, "each left miniheap is checked against at most 64 candidates");
+
+  if (candidates.size() < 2)
     return;
 
-  internal::vector<MiniHeap *> leftBucket{};   // mutable copy
-  internal::vector<MiniHeap *> rightBucket{};  // mutable copy
+  auto &leftBucket = scratch.left;
+  auto &rightBucket = scratch.right;
+  leftBucket.clear();
+  rightBucket.clear();
 
-  halfSplit(prng, miniheaps, leftBucket, rightBucket);
+  halfSplit(prng, candidates, leftBucket, rightBucket);
 
   const auto leftSize = leftBucket.size();
   const auto rightSize = rightBucket.size();
@@ -84,37 +255,257 @@ inline void shiftedSplitting(MWC &prng, BinnedTracker &miniheaps,
   const size_t limit = rightSize < t ? rightSize : t;
   constexpr size_t nBytes = 32;
   d_assert(nBytes == leftBucket[0]->bitmap().byteCount());
+  d_assert(nBytes == sizeof(PackedBitmap));
+
+  // left miniheap j is compared against right miniheaps j, j+1, ...
+  // j+limit-1 (mod rightSize).  Copy the right bitmaps out with the
+  // first limit repeated at the end, so that each of those windows is
+  // contiguous.  Right miniheaps that have been meshed get an all-ones
+  // bitmap so they (almost never) match again.
+  auto &rightBitmaps = scratch.bitmaps;
+  rightBitmaps.resize(rightSize + limit);
+  for (size_t i = 0; i < rightSize + limit; i++) {
+    rightBitmaps[i].copyFrom(rightBucket[i % rightSize]->bitmap().bits());
+  }
 
   size_t foundCount = 0;
   for (size_t j = 0; j < leftSize; j++) {
-    const size_t idxLeft = j;
-    size_t idxRight = j;
-    for (size_t i = 0; i < limit; i++, idxRight++) {
-      if (unlikely(idxRight >= rightSize)) {
-        idxRight %= rightSize;
-      }
-      auto h1 = leftBucket[idxLeft];
-      auto h2 = rightBucket[idxRight];
+    auto h1 = leftBucket[j];
+
+    PackedBitmap bitmap1;
+    bitmap1.copyFrom(h1->bitmap().bits());
 
-      if (h1 == nullptr || h2 == nullptr)
+    const size_t start = j % rightSize;
+    uint64_t candidates = meshableMask(bitmap1, &rightBitmaps[start], limit);
+    while (unlikely(candidates != 0)) {
+      const size_t idxRight = (start + __builtin_ctzll(candidates)) % rightSize;
+      candidates &= candidates - 1;
+
+      auto h2 = rightBucket[idxRight];
+      if (h2 == nullptr)
         continue;
 
-      const auto bitmap1 = h1->bitmap().bits();
-      const auto bitmap2 = h2->bitmap().bits();
+      std::pair<MiniHeap *, MiniHeap *> heaps{h1, h2};
+      meshFound(std::move(heaps));
+      rightBucket[idxRight] = nullptr;
+      rightBitmaps[idxRight].setAll();
+      if (idxRight < limit) {
+        rightBitmaps[rightSize + idxRight].setAll();
+      }
+      foundCount++;
+      if (foundCount > kMaxMeshesPerIteration) {
+        return;
+      }
+      break;
+    }
+  }
+}
+
+template <size_t t = 64>
+inline void shiftedSplitting(MWC &prng, internal::vector<MiniHeap *> &candidates,
+                             const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound) noexcept {
+  MeshScratch scratch{};
+  shiftedSplitting<t>(prng, candidates, scratch, meshFound);
+}
+
+// a greedy mesher after the one in theory/meshers.py: candidates are
+// sorted by increasing occupancy, and each is paired with the fullest
+// of the next t candidates it meshes with (a best fit by popcount,
+// leaving the emptiest miniheaps to absorb the hard-to-place ones).
+// This costs more CPU time than shiftedSplitting's (t = 64) but
+// typically finds more meshes.  Like shiftedSplitting, it only reads
+// the candidates' bitmaps.
+// fills scratch.left with candidates sorted by increasing occupancy,
+// and scratch.bitmaps with their packed bitmaps; returns how many
+inline size_t sortByOccupancy(MWC &prng, internal::vector<MiniHeap *> &candidates, MeshScratch &scratch) noexcept {
+  auto &bucket = scratch.left;
+  bucket.clear();
+  for (auto mh : candidates) {
+    if (!mh->isMeshingCandidate() || mh->fullness() >= kOccupancyCutoff)
+      continue;
+    bucket.push_back(mh);
+  }
+
+  const auto size = bucket.size();
+  if (size < 2)
+    return size;
+
+  // shuffle first so that ties aren't always broken the same way
+  internal::mwcShuffle(bucket.begin(), bucket.end(), prng);
+  std::stable_sort(bucket.begin(), bucket.end(),
+                   [](const MiniHeap *a, const MiniHeap *b) { return a->inUseCount() < b->inUseCount(); });
+
+  d_assert(sizeof(PackedBitmap) == bucket[0]->bitmap().byteCount());
+
+  auto &bitmaps = scratch.bitmaps;
+  bitmaps.resize(size);
+  for (size_t i = 0; i < size; i++) {
+    bitmaps[i].copyFrom(bucket[i]->bitmap().bits());
+  }
+
+  return size;
+}
+
+template <size_t t = 1024>
+inline void greedyMatching(MWC &prng, internal::vector<MiniHeap *> &candidates, MeshScratch &scratch,
+                           const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound) noexcept {
+  if (candidates.size() < 2)
+    return;
+
+  const auto size = sortByOccupancy(prng, candidates, scratch);
+  if (size < 2)
+    return;
+
+  // as in shiftedSplitting, meshed miniheaps get an all-ones bitmap
+  auto &bucket = scratch.left;
+  auto &bitmaps = scratch.bitmaps;
+
+  size_t foundCount = 0;
+  for (size_t i = 0; i + 1 < size; i++) {
+    auto h1 = bucket[i];
+    if (h1 == nullptr)
+      continue;
+
+    // bucket is sorted by occupancy, so the fullest match is the last
+    // one: scan the window back to front, from its highest bit down
+    const size_t end = std::min(size, i + 1 + t);
+    size_t stop = end;
+    while (h1 != nullptr && stop > i + 1) {
+      const size_t count = std::min(stop - (i + 1), kernel::kMaxMaskCandidates);
+      const size_t start = stop - count;
+      uint64_t matches = meshableMask(bitmaps[i], &bitmaps[start], count);
+      while (unlikely(matches != 0)) {
+        const size_t bit = 63 - __builtin_clzll(matches);
+        const size_t j = start + bit;
+        matches &= ~(static_cast<uint64_t>(1) << bit);
+
+        auto h2 = bucket[j];
+        if (h2 == nullptr)
+          continue;
+
+        std::pair<MiniHeap *, MiniHeap *> heaps{h1, h2};
+        meshFound(std::move(heaps));
+        bucket[j] = nullptr;
+        bitmaps[j].setAll();
+        h1 = nullptr;
+        break;
+      }
+
+      stop = start;
+    }
+
+    if (h1 == nullptr) {
+      foundCount++;
+      if (foundCount > kMaxMeshesPerIteration) {
+        return;
+      }
+    }
+  }
+}
+
+template <size_t t = 1024>
+inline void greedyMatching(MWC &prng, internal::vector<MiniHeap *> &candidates,
+                           const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound) noexcept {
+  MeshScratch scratch{};
+  greedyMatching<t>(prng, candidates, scratch, meshFound);
+}
+
+// like greedyMatching, but a candidate below kMultiWayOccupancyCutoff
+// gathers up to groupSize - 1 partners whose bitmaps are disjoint from
+// each other's as well as from its own, emptiest first.  A group is
+// reported as consecutive pairs sharing their first miniheap, which
+// GlobalHeap::meshSizeClass meshes in a single batch, so that e.g.
+// after a wave of frees k sparse spans collapse into one in a single
+// pass rather than over log2(k) of them.
+template <size_t t = 1024>
+inline void multiWayMatching(MWC &prng, internal::vector<MiniHeap *> &candidates, MeshScratch &scratch,
+                             const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound,
+                             size_t groupSize = kMeshGroupSize) noexcept {
+  d_assert(groupSize >= 2 && groupSize <= kMaxMeshGroupSize);
+
+  if (candidates.size() < 2)
+    return;
+
+  const auto size = sortByOccupancy(prng, candidates, scratch);
+  if (size < 2)
+    return;
+
+  auto &bucket = scratch.left;
+  auto &bitmaps = scratch.bitmaps;
+
+  size_t foundCount = 0;
+  for (size_t i = 0; i + 1 < size; i++) {
+    auto h1 = bucket[i];
+    if (h1 == nullptr)
+      continue;
+
+    const size_t maxPartners = h1->fullness() < kMultiWayOccupancyCutoff ? groupSize - 1 : 1;
+    size_t partners = 0;
+    PackedBitmap group = bitmaps[i];
+
+    const size_t end = std::min(size, i + 1 + t);
+    for (size_t start = i + 1; start < end && partners < maxPartners; start += kernel::kMaxMaskCandidates) {
+      const size_t count = std::min(end - start, kernel::kMaxMaskCandidates);
+      uint64_t matches = meshableMask(group, &bitmaps[start], count);
+      while (unlikely(matches != 0) && partners < maxPartners) {
+        const size_t j = start + __builtin_ctzll(matches);
+        matches &= matches - 1;
+
+        auto h2 = bucket[j];
+        // the mask was computed against the group before its latest
+        // members joined
+        if (h2 == nullptr || !group.disjointWith(bitmaps[j]))
+          continue;
 
-      if (unlikely(mesh::bitmapsMeshable(bitmap1, bitmap2, nBytes))) {
         std::pair<MiniHeap *, MiniHeap *> heaps{h1, h2};
         meshFound(std::move(heaps));
-        leftBucket[idxLeft] = nullptr;
-        rightBucket[idxRight] = nullptr;
-        foundCount++;
-        if (foundCount > kMaxMeshesPerIteration) {
-          return;
-        }
+        group.orWith(bitmaps[j]);
+        bucket[j] = nullptr;
+        bitmaps[j].setAll();
+        partners++;
+      }
+    }
+
+    if (partners > 0) {
+      foundCount += partners;
+      if (foundCount > kMaxMeshesPerIteration) {
+        return;
       }
     }
   }
 }
+
+template <size_t t = 1024>
+inline void multiWayMatching(MWC &prng, internal::vector<MiniHeap *> &candidates,
+                             const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound,
+                             size_t groupSize = kMeshGroupSize) noexcept {
+  MeshScratch scratch{};
+  multiWayMatching<t>(prng, candidates, scratch, meshFound, groupSize);
+}
+
+// matching algorithms as policies, for code that picks one at compile
+// time; GlobalHeap picks one at runtime by MeshMethod (see the
+// mesh.method mallctl)
+struct ShiftedSplitting {
+  static inline void findMeshes(MWC &prng, internal::vector<MiniHeap *> &candidates, MeshScratch &scratch,
+                                const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound) noexcept {
+    shiftedSplitting(prng, candidates, scratch, meshFound);
+  }
+};
+
+struct GreedyMatching {
+  static inline void findMeshes(MWC &prng, internal::vector<MiniHeap *> &candidates, MeshScratch &scratch,
+                                const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound) noexcept {
+    greedyMatching(prng, candidates, scratch, meshFound);
+  }
+};
+
+struct MultiWayMatching {
+  static inline void findMeshes(MWC &prng, internal::vector<MiniHeap *> &candidates, MeshScratch &scratch,
+                                const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound) noexcept {
+    multiWayMatching(prng, candidates, scratch, meshFound);
+  }
+};
 }  // namespace method
 }  // namespace mesh
 
@@ -32,6 +32,8 @@ private:
     return 1UL << pos;
   }
   static constexpr uint32_t MeshedOffset = 30;
+  static constexpr uint32_t HugePageOffset = 29;
+  static constexpr uint32_t NumaNodeShift = 25;
   static constexpr uint32_t MaxCountShift = 16;
   static constexpr uint32_t SizeClassShift = 0;
   static constexpr uint32_t ShuffleVectorOffsetShift = 8;
@@ -83,6 +85,31 @@ public:
     return is(MeshedOffset);
   }
 
+  inline uint32_t numaNode() const {
+    return (_flags.load(std::memory_order_relaxed) >> NumaNodeShift) & 0xf;
+  }
+
+  inline void setNumaNode(uint32_t node) {
+    d_assert(node < kMaxNumaNodes);
+    uint32_t mask = ~(static_cast<uint32_t>(0xf) << NumaNodeShift);
+    uint32_t newVal = (node << NumaNodeShift);
+    uint32_t oldFlags = _flags.load(std::memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&_flags,
+                                                  &oldFlags,                   // old val
+                                                  (oldFlags & mask) | newVal,  // new val
+                                                  std::memory_order_release,   // success mem model
+                                                  std::memory_order_relaxed)) {
+    }
+  }
+
+  inline void setHugePage() {
+    set(HugePageOffset);
+  }
+
+  inline bool isHugePage() const {
+    return is(HugePageOffset);
+  }
+
 private:
   inline bool ATTRIBUTE_ALWAYS_INLINE is(size_t offset) const {
     const auto mask = getMask(offset);
@@ -172,6 +199,21 @@ public:
     freeOff(off);
   }
 
+  // clears the bit for ptr without any locking, returning false if
+  // the bit was already clear.  Outside of a double free, that means
+  // a concurrent mesh snapshotted (and cleared) our bitmap in
+  // consume() before we got to it, and the free has to be redone
+  // against the MiniHeap that now owns ptr.
+  inline bool ATTRIBUTE_ALWAYS_INLINE tryFree(void *arenaBegin, void *ptr) {
+    const ssize_t off = getOff(arenaBegin, ptr);
+    if (unlikely(off < 0)) {
+      d_assert(false);
+      return true;
+    }
+
+    return !_bitmap.unset(off);
+  }
+
   inline void ATTRIBUTE_ALWAYS_INLINE freeOff(size_t off) {
     d_assert_msg(_bitmap.isSet(off), "MiniHeap(%p) expected bit %zu to be set (svOff:%zu)", this, off, svOffset());
     _bitmap.unset(off);
@@ -186,10 +228,20 @@ public:
     src->setMeshed();
     const auto srcSpan = src->getSpanStart(arenaBegin);
 
+    // atomically snapshot and clear src's bitmap.  Lock-free frees
+    // (see GlobalHeap::freeFor) that clear their bit before this are
+    // simply not copied; ones that come after find their bit already
+    // clear and retry against us once the mesh has finished.
+    internal::RelaxedFixedBitmap srcBits{src->maxCount()};
+    const internal::RelaxedFixedBitmap emptyBits{src->maxCount()};
+    src->_bitmap.setAndExchangeAll(srcBits.mut_bits(), emptyBits.bits());
+
     // for each object in src, copy it to our backing span + update
     // our bitmap and in-use count
-    for (auto const &off : src->bitmap()) {
-      d_assert(off < maxCount());
+    for (auto const &off : srcBits) {
+      if (off >= maxCount()) {
+        break;
+      }
       d_assert(!_bitmap.isSet(off));
 
       void *srcObject = reinterpret_cast<void *>(srcSpan + off * objectSize());
@@ -200,7 +252,6 @@ public:
       memcpy(dstObject, srcObject, objectSize());
       // debug("\t'%s'\n", dstObject);
       // debug("\t'%s'\n", srcObject);
-      src->freeOff(off);
     }
 
     trackMeshedSpan(GetMiniHeapID(src));
@@ -282,8 +333,27 @@ public:
     return _nextMiniHeap.hasValue();
   }
 
+  // the memory node the span's pages are placed on
+  inline uint32_t numaNode() const {
+    return _flags.numaNode();
+  }
+
+  inline void setNumaNode(uint32_t node) {
+    _flags.setNumaNode(node);
+  }
+
+  // spans in the arena's huge page region can't be remapped a page at
+  // a time, so they are never meshed
+  inline void setHugePage() {
+    _flags.setHugePage();
+  }
+
+  inline bool isHugePage() const {
+    return _flags.isHugePage();
+  }
+
   inline bool isMeshingCandidate() const {
-    return !isAttached() && objectSize() < kPageSize;
+    return !isAttached() && objectSize() < kPageSize && !isHugePage();
   }
 
   /// Returns the fraction full (in the range [0, 1]) that this miniheap is.
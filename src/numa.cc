@@ -0,0 +1,134 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+#include "common.h"
+#include "numa.h"
+
+namespace mesh {
+namespace numa {
+
+// CPUs past the end of the table are treated as being on node 0
+static constexpr size_t kMaxNumaCPUs = 1024;
+
+static size_t NodeCount = 1;
+static uint8_t CPUNode[kMaxNumaCPUs];
+
+// read a small sysfs file into buf, NUL-terminated.  We can't use
+// stdio here, as it would allocate from the heap being set up.
+static bool readFile(const char *path, char *buf, size_t len) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  ssize_t bytesRead = read(fd, buf, len - 1);
+  close(fd);
+
+  if (bytesRead <= 0)
+    return false;
+
+  buf[bytesRead] = 0;
+  return true;
+}
+
+// call fn(first, last) for each range in a list like "0-3,8,10-11"
+template <typename Func>
+static void forEachRange(const char *list, const Func func) {
+  const char *p = list;
+  while (*p >= '0' && *p <= '9') {
+    char *end = nullptr;
+    const long first = strtol(p, &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+    func(first, last);
+    if (*end != ',')
+      break;
+    p = end + 1;
+  }
+}
+
+void init() {
+  char buf[4096];
+
+  if (!readFile("/sys/devices/system/node/possible", buf, sizeof(buf))) {
+    return;
+  }
+
+  long maxNode = 0;
+  forEachRange(buf, [&](long first, long last) { maxNode = last > maxNode ? last : maxNode; });
+  if (maxNode == 0) {
+    return;
+  }
+
+  // nodes we can't tell apart in a MiniHeap's flags share placement
+  const size_t nodeCount = static_cast<size_t>(maxNode) + 1;
+  NodeCount = nodeCount < kMaxNumaNodes ? nodeCount : kMaxNumaNodes;
+
+  for (size_t node = 0; node < nodeCount; node++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+    if (!readFile(path, buf, sizeof(buf))) {
+      continue;
+    }
+    forEachRange(buf, [&](long first, long last) {
+      for (long cpu = first; cpu <= last && cpu < static_cast<long>(kMaxNumaCPUs); cpu++) {
+        CPUNode[cpu] = node % kMaxNumaNodes;
+      }
+    });
+  }
+}
+
+void disable() {
+  NodeCount = 1;
+}
+
+size_t nodeCount() {
+  return NodeCount;
+}
+
+int currentNode() {
+  if (NodeCount == 1) {
+    return 0;
+  }
+
+  // glibc reads this from the rseq area or the vDSO, without a syscall
+  const int cpu = sched_getcpu();
+  if (unlikely(cpu < 0 || static_cast<size_t>(cpu) >= kMaxNumaCPUs)) {
+    return 0;
+  }
+
+  return CPUNode[cpu];
+}
+
+void bind(void *ptr, size_t sz, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+  if (NodeCount == 1) {
+    return;
+  }
+
+  // MPOL_PREFERRED rather than MPOL_BIND: when the node runs out of
+  // memory, remote pages are better than failing the allocation
+  unsigned long nodemask = 1UL << node;
+  syscall(SYS_mbind, ptr, sz, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0);
+#endif
+}
+
+}  // namespace numa
+}  // namespace mesh
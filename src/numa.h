@@ -0,0 +1,39 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__NUMA_H
+#define MESH__NUMA_H
+
+#include <stddef.h>
+
+namespace mesh {
+namespace numa {
+
+// read the machine's memory nodes and which CPUs belong to them.
+// Called once, before anything else here, when the arena is created;
+// it doesn't allocate.
+void init();
+
+// treat the machine as a single node from now on
+void disable();
+
+// the number of nodes memory is placed on: 1 on machines without
+// NUMA, and never more than kMaxNumaNodes
+size_t nodeCount();
+
+// the node of the CPU the calling thread is running on.  Threads can
+// migrate at any time, so this is only ever a placement hint.
+int currentNode();
+
+// prefer placing the pages backing [ptr, ptr + sz) on node.  For the
+// arena's shared memory file the policy sticks to the file's pages,
+// so it survives remapping them.
+void bind(void *ptr, size_t sz, int node);
+
+}  // namespace numa
+}  // namespace mesh
+
+#endif  // MESH__NUMA_H
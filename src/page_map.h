@@ -0,0 +1,110 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__PAGE_MAP_H
+#define MESH__PAGE_MAP_H
+
+#include <atomic>
+
+#include "internal.h"
+#include "one_way_mmap_heap.h"
+
+namespace mesh {
+
+// the MiniHeap owning each page of the arena, as a two-level map: a
+// root pointing to one leaf per huge page of arena.  Leaves are only
+// allocated (by ensure, under the arena lock) as the arena grows, a
+// batch at a time so that neighbouring leaves stay close in memory,
+// and are never freed -- so lookups take no lock, and a Cache of the
+// last leaf looked up stays valid forever.
+class PageMap {
+private:
+  DISALLOW_COPY_AND_ASSIGN(PageMap);
+
+public:
+  typedef atomic<MiniHeapID> Leaf;
+
+  static constexpr size_t kLeafPages = kHugePageSize / kPageSize;
+  static constexpr size_t kLeafShift = __builtin_ctzl(kLeafPages);
+  static constexpr size_t kRootSize = kMaxArenaSize / kPageSize / kLeafPages;
+
+  static_assert((kLeafPages & (kLeafPages - 1)) == 0, "leaves must cover a power of two pages");
+
+  // the leaf a thread last looked up a page in
+  struct Cache {
+    size_t index{kRootSize};
+    const Leaf *leaf{nullptr};
+  };
+
+  PageMap()
+      : _root(reinterpret_cast<atomic<Leaf *> *>(OneWayMmapHeap().malloc(kRootSize * sizeof(atomic<Leaf *>)))) {
+    hard_assert(_root != nullptr);
+  }
+
+  // allocate the leaves covering [offset, offset + pageCount)
+  void ensure(Offset offset, size_t pageCount) {
+    d_assert(offset + pageCount <= kRootSize * kLeafPages);
+    if (pageCount == 0) {
+      return;
+    }
+
+    const size_t first = offset >> kLeafShift;
+    const size_t last = (offset + pageCount - 1) >> kLeafShift;
+
+    size_t missing = 0;
+    for (size_t i = first; i <= last; i++) {
+      missing += _root[i].load(std::memory_order_relaxed) == nullptr;
+    }
+    if (missing == 0) {
+      return;
+    }
+
+    // fresh anonymous memory is zero: every page starts out unowned
+    auto leaves = reinterpret_cast<Leaf *>(OneWayMmapHeap().malloc(missing * kLeafPages * sizeof(Leaf)));
+    hard_assert(leaves != nullptr);
+    for (size_t i = first; i <= last; i++) {
+      if (_root[i].load(std::memory_order_relaxed) == nullptr) {
+        _root[i].store(leaves, std::memory_order_release);
+        leaves += kLeafPages;
+      }
+    }
+  }
+
+  inline MiniHeapID ATTRIBUTE_ALWAYS_INLINE get(Offset offset) const {
+    const Leaf *leaf = _root[offset >> kLeafShift].load(std::memory_order_acquire);
+    if (unlikely(leaf == nullptr)) {
+      return MiniHeapID{0};
+    }
+    return leaf[offset & (kLeafPages - 1)].load(std::memory_order_acquire);
+  }
+
+  // get, skipping the root when offset is in the cached leaf
+  inline MiniHeapID ATTRIBUTE_ALWAYS_INLINE get(Offset offset, Cache &cache) const {
+    const size_t index = offset >> kLeafShift;
+    if (unlikely(index != cache.index)) {
+      const Leaf *leaf = _root[index].load(std::memory_order_acquire);
+      if (unlikely(leaf == nullptr)) {
+        return MiniHeapID{0};
+      }
+      cache.index = index;
+      cache.leaf = leaf;
+    }
+    return cache.leaf[offset & (kLeafPages - 1)].load(std::memory_order_acquire);
+  }
+
+  // offset's leaf must have been allocated by ensure
+  inline void set(Offset offset, MiniHeapID id) {
+    Leaf *leaf = _root[offset >> kLeafShift].load(std::memory_order_relaxed);
+    d_assert(leaf != nullptr);
+    leaf[offset & (kLeafPages - 1)].store(id, std::memory_order_release);
+  }
+
+private:
+  atomic<Leaf *> *const _root;
+};
+}  // namespace mesh
+
+#endif  // MESH__PAGE_MAP_H
@@ -0,0 +1,153 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__PARKED_HEAP_POOL_H
+#define MESH__PARKED_HEAP_POOL_H
+
+#include <mutex>
+
+#include "common.h"
+#include "fixed_array.h"
+#include "mini_heap.h"
+
+namespace mesh {
+
+// A bounded pool of the partially free MiniHeaps that exiting threads'
+// heaps had attached, one entry per exited heap.  A new thread's heap
+// adopts a whole entry at once, so it starts out with MiniHeaps to
+// refill its shuffle vectors from instead of going to the global heap
+// for every size class.
+//
+// Parked MiniHeaps stay attached -- to an id unique to their entry --
+// so they aren't meshed; entries older than kParkedHeapMaxAge are
+// released back to the global heap.
+class ParkedHeapPool {
+private:
+  DISALLOW_COPY_AND_ASSIGN(ParkedHeapPool);
+
+public:
+  typedef FixedArray<MiniHeap, kMaxMiniheapsPerShuffleVector> MiniHeapArray;
+
+  ParkedHeapPool() {
+  }
+
+  // move the MiniHeaps out of miniheaps[1..kNumBins) into a free
+  // entry.  Full MiniHeaps can't be allocated from, so they are handed
+  // to release instead.  Returns false, leaving miniheaps untouched,
+  // if the pool is full.
+  template <typename Release>
+  bool park(MiniHeapArray *miniheaps[kNumBins], const Release &release) {
+    lock_guard<mutex> lock(_lock);
+
+    ParkedHeap *entry = nullptr;
+    for (size_t i = 0; i < kMaxParkedHeaps; i++) {
+      if (_entries[i].id == 0) {
+        entry = &_entries[i];
+        break;
+      }
+    }
+    if (entry == nullptr) {
+      return false;
+    }
+
+    entry->id = nextID();
+    entry->parkedAt = time::now();
+    for (size_t sizeClass = 1; sizeClass < kNumBins; sizeClass++) {
+      for (auto mh : *miniheaps[sizeClass]) {
+        if (mh->isFull()) {
+          release(mh);
+          continue;
+        }
+        mh->setAttached(entry->id);
+        entry->miniheaps[sizeClass].append(mh);
+      }
+      miniheaps[sizeClass]->clear();
+    }
+
+    return true;
+  }
+
+  // move the MiniHeaps of the most recently parked entry into
+  // miniheaps, which must be empty.  Returns the id they are attached
+  // to, or 0 if the pool is empty.
+  pid_t adopt(MiniHeapArray *miniheaps[kNumBins]) {
+    lock_guard<mutex> lock(_lock);
+
+    ParkedHeap *entry = nullptr;
+    for (size_t i = 0; i < kMaxParkedHeaps; i++) {
+      if (_entries[i].id != 0 && (entry == nullptr || _entries[i].parkedAt > entry->parkedAt)) {
+        entry = &_entries[i];
+      }
+    }
+    if (entry == nullptr) {
+      return 0;
+    }
+
+    for (size_t sizeClass = 1; sizeClass < kNumBins; sizeClass++) {
+      d_assert(miniheaps[sizeClass]->size() == 0);
+      for (auto mh : entry->miniheaps[sizeClass]) {
+        miniheaps[sizeClass]->append(mh);
+      }
+      entry->miniheaps[sizeClass].clear();
+    }
+
+    const pid_t id = entry->id;
+    entry->id = 0;
+    return id;
+  }
+
+  // hand the MiniHeaps of every entry parked before cutoff to release
+  template <typename Release>
+  void releaseParkedBefore(time::time_point cutoff, const Release &release) {
+    lock_guard<mutex> lock(_lock);
+
+    for (size_t i = 0; i < kMaxParkedHeaps; i++) {
+      auto &entry = _entries[i];
+      if (entry.id == 0 || entry.parkedAt >= cutoff) {
+        continue;
+      }
+      for (size_t sizeClass = 1; sizeClass < kNumBins; sizeClass++) {
+        for (auto mh : entry.miniheaps[sizeClass]) {
+          release(mh);
+        }
+        entry.miniheaps[sizeClass].clear();
+      }
+      entry.id = 0;
+    }
+  }
+
+  void lock() {
+    _lock.lock();
+  }
+
+  void unlock() {
+    _lock.unlock();
+  }
+
+private:
+  struct ParkedHeap {
+    pid_t id{0};  // 0 if this entry is free
+    time::time_point parkedAt{};
+    MiniHeapArray miniheaps[kNumBins]{};
+  };
+
+  // must be called with _lock held.  After wrapping around an id can
+  // only collide with a heap still using one handed out ~half a
+  // billion parks earlier.
+  pid_t nextID() {
+    if (_nextID >= kTransferCacheID) {
+      _nextID = kParkedHeapIDBase;
+    }
+    return _nextID++;
+  }
+
+  mutex _lock{};
+  pid_t _nextID{kParkedHeapIDBase};
+  ParkedHeap _entries[kMaxParkedHeaps]{};
+};
+}  // namespace mesh
+
+#endif  // MESH__PARKED_HEAP_POOL_H
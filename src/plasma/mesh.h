@@ -26,6 +26,14 @@ int mesh_in_bounds(void *ptr);
 // returns the usable size of an allocation
 size_t mesh_usable_size(void *ptr);
 
+// allocates count objects of size sz into ptrs, returning the number
+// of objects allocated (less than count only if out of memory).
+size_t mesh_malloc_batch(size_t sz, void **ptrs, size_t count);
+
+// frees count pointers, e.g. as returned by mesh_malloc_batch.  NULL
+// entries are ignored.
+void mesh_free_batch(void **ptrs, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,226 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "punch_ring.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(IORING_FEAT_NODROP)
+#define MESH_HAVE_IO_URING 1
+#endif
+
+namespace mesh {
+
+#ifdef MESH_HAVE_IO_URING
+
+static inline unsigned loadAcquire(const unsigned *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void storeRelease(unsigned *p, unsigned v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline int ringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+bool PunchRing::init() {
+  d_assert(_ringFd < 0);
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, kPunchRingDepth, &params);
+  if (fd < 0) {
+    return false;
+  }
+
+  // completions are never dropped while we keep no more than
+  // sq_entries requests in flight
+  if (!(params.features & IORING_FEAT_NODROP) || params.sq_entries < kPunchRingDepth) {
+    close(fd);
+    return false;
+  }
+
+  _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMmap) {
+    _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+  }
+
+  _sqRing = mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (_sqRing == MAP_FAILED) {
+    _sqRing = nullptr;
+    close(fd);
+    return false;
+  }
+  _cqRing = _sqRing;
+  if (!singleMmap) {
+    _cqRing = mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (_cqRing == MAP_FAILED) {
+      _cqRing = nullptr;
+      _ringFd = fd;
+      reset();
+      return false;
+    }
+  }
+
+  _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    _ringFd = fd;
+    reset();
+    return false;
+  }
+  _sqes = reinterpret_cast<io_uring_sqe *>(sqes);
+
+  char *sq = reinterpret_cast<char *>(_sqRing);
+  _sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  _sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  _sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+  char *cq = reinterpret_cast<char *>(_cqRing);
+  _cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  _cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  _cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  _cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+  _queued = 0;
+  _inFlight = 0;
+  _ringFd = fd;
+
+  return true;
+}
+
+void PunchRing::reset() {
+  if (_sqes != nullptr) {
+    munmap(_sqes, _sqesSize);
+  }
+  if (_cqRing != nullptr && _cqRing != _sqRing) {
+    munmap(_cqRing, _cqRingSize);
+  }
+  if (_sqRing != nullptr) {
+    munmap(_sqRing, _sqRingSize);
+  }
+  if (_ringFd >= 0) {
+    close(_ringFd);
+  }
+
+  _ringFd = -1;
+  _sqRing = _cqRing = nullptr;
+  _sqes = nullptr;
+  _cqes = nullptr;
+  _queued = 0;
+  _inFlight = 0;
+}
+
+bool PunchRing::queue(int fd, off_t off, off_t len, uint64_t tag) {
+  d_assert(enabled());
+
+  if (_inFlight >= kPunchRingDepth) {
+    return false;
+  }
+
+  // we're the only producer, so the tail is ours to read relaxed
+  const unsigned tail = *_sqTail;
+  const unsigned index = tail & *_sqMask;
+
+  struct io_uring_sqe *sqe = &_sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_FALLOCATE;
+  sqe->fd = fd;
+  sqe->off = off;
+  sqe->addr = len;
+  sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+  sqe->user_data = tag;
+
+  _sqArray[index] = index;
+  storeRelease(_sqTail, tail + 1);
+
+  _queued++;
+  _inFlight++;
+
+  return true;
+}
+
+void PunchRing::submit() {
+  while (_queued > 0) {
+    int submitted = ringEnter(_ringFd, _queued, 0, 0);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // leave them queued: the next submit or reap retries
+      d_assert_msg(false, "io_uring submit failed: %d", errno);
+      return;
+    }
+    _queued -= submitted;
+  }
+}
+
+size_t PunchRing::reap(bool wait, uint64_t *tags, int *results, size_t count) {
+  d_assert(enabled());
+
+  unsigned head = *_cqHead;
+  if (wait && _inFlight > 0 && head == loadAcquire(_cqTail)) {
+    int submitted = ringEnter(_ringFd, _queued, 1, IORING_ENTER_GETEVENTS);
+    if (submitted > 0) {
+      _queued -= submitted;
+    } else if (submitted < 0 && errno != EINTR) {
+      d_assert_msg(false, "io_uring wait failed: %d", errno);
+    }
+  }
+
+  size_t reaped = 0;
+  const unsigned tail = loadAcquire(_cqTail);
+  for (; head != tail && reaped < count; head++, reaped++) {
+    const struct io_uring_cqe *cqe = &_cqes[head & *_cqMask];
+    tags[reaped] = cqe->user_data;
+    results[reaped] = cqe->res;
+  }
+  storeRelease(_cqHead, head);
+
+  d_assert(_inFlight >= reaped);
+  _inFlight -= reaped;
+
+  return reaped;
+}
+
+#else
+
+bool PunchRing::init() {
+  return false;
+}
+
+void PunchRing::reset() {
+}
+
+bool PunchRing::queue(int fd, off_t off, off_t len, uint64_t tag) {
+  return false;
+}
+
+void PunchRing::submit() {
+}
+
+size_t PunchRing::reap(bool wait, uint64_t *tags, int *results, size_t count) {
+  return 0;
+}
+
+#endif  // MESH_HAVE_IO_URING
+}  // namespace mesh
@@ -0,0 +1,82 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__PUNCH_RING_H
+#define MESH__PUNCH_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace mesh {
+
+// an io_uring used to punch holes in the arena's file asynchronously:
+// requests are queued in batches, run by the kernel while we go on
+// without the arena lock, and only reaped -- making their pages safe
+// to hand out again -- later.  At most kPunchRingDepth requests are in
+// flight at once.  Not thread safe: the arena's lock protects it.
+class PunchRing {
+private:
+  DISALLOW_COPY_AND_ASSIGN(PunchRing);
+
+public:
+  PunchRing() {
+  }
+
+  // set the ring up, returning false if io_uring isn't available
+  bool init();
+  // tear the ring down (after fork, the child's copy of its parent's)
+  void reset();
+
+  inline bool enabled() const {
+    return _ringFd >= 0;
+  }
+
+  // requests queued or submitted, but not yet reaped
+  inline size_t inFlight() const {
+    return _inFlight;
+  }
+
+  // queue punching [off, off + len) out of fd, tagged with tag.
+  // Returns false if kPunchRingDepth requests are already in flight.
+  bool queue(int fd, off_t off, off_t len, uint64_t tag);
+  // hand the queued requests to the kernel
+  void submit();
+  // store the tag and result (0 or a -errno) of up to count completed
+  // requests, returning how many.  With wait set, first blocks until
+  // at least one completes if any are in flight.
+  size_t reap(bool wait, uint64_t *tags, int *results, size_t count);
+
+private:
+  int _ringFd{-1};
+
+  void *_sqRing{nullptr};
+  size_t _sqRingSize{0};
+  void *_cqRing{nullptr};
+  size_t _cqRingSize{0};
+  io_uring_sqe *_sqes{nullptr};
+  size_t _sqesSize{0};
+
+  unsigned *_sqTail{nullptr};
+  unsigned *_sqMask{nullptr};
+  unsigned *_sqArray{nullptr};
+  unsigned *_cqHead{nullptr};
+  unsigned *_cqTail{nullptr};
+  unsigned *_cqMask{nullptr};
+  io_uring_cqe *_cqes{nullptr};
+
+  // written to the submission queue, but not yet submitted
+  unsigned _queued{0};
+  size_t _inFlight{0};
+};
+}  // namespace mesh
+
+#endif  // MESH__PUNCH_RING_H
@@ -64,20 +64,58 @@ size_t internal::measurePssKiB() {
   return atoi(&start[6]);
 }
 
-int internal::copyFile(int dstFd, int srcFd, off_t off, size_t sz) {
+ssize_t internal::copyFile(int dstFd, int srcFd, off_t off, size_t sz) {
   d_assert(off >= 0);
 
+#if defined(__APPLE__) || defined(__FreeBSD__)
   off_t newOff = lseek(dstFd, off, SEEK_SET);
   d_assert(newOff == off);
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
 #warning test that setting offset on dstFd works as intended
   // fcopyfile works on FreeBSD and OS X 10.5+
   int result = fcopyfile(srcFd, dstFd, 0, COPYFILE_ALL);
 #else
-  errno = 0;
-  // sendfile will work with non-socket output (i.e. regular file) on Linux 2.6.33+
-  int result = sendfile(dstFd, srcFd, &off, sz);
+  size_t copied = 0;
+
+#ifdef __NR_copy_file_range
+  // copy in the kernel, without reading the pages into a pipe
+  // buffer, where copy_file_range works between our files (4.5+)
+  static bool copyFileRangeWorks = true;
+  while (copyFileRangeWorks && copied < sz) {
+    loff_t inOff = off + copied;
+    loff_t outOff = off + copied;
+    const ssize_t n = syscall(__NR_copy_file_range, srcFd, &inOff, dstFd, &outOff, sz - copied, 0);
+    if (n > 0) {
+      copied += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+      copyFileRangeWorks = false;
+    } else {
+      return copied > 0 ? copied : n;
+    }
+  }
+#endif
+
+  if (copied < sz) {
+    off_t newOff = lseek(dstFd, off + copied, SEEK_SET);
+    d_assert(newOff == static_cast<off_t>(off + copied));
+  }
+  while (copied < sz) {
+    errno = 0;
+    off_t inOff = off + copied;
+    // sendfile will work with non-socket output (i.e. regular file) on Linux 2.6.33+
+    const ssize_t n = sendfile(dstFd, srcFd, &inOff, sz - copied);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return copied > 0 ? copied : n;
+    }
+    copied += n;
+  }
+
+  ssize_t result = copied;
 #endif
 
   return result;
@@ -142,7 +180,9 @@ void *Runtime::startThread(StartThreadArgs *threadArgs) {
   mesh::internal::Heap().free(threadArgs);
   threadArgs = nullptr;
 
-  runtime->installSegfaultHandler();
+  if (runtime->heap().needsSegfaultHandler()) {
+    runtime->installSegfaultHandler();
+  }
 
   return startRoutine(arg);
 }
@@ -154,7 +194,7 @@ void Runtime::exitThread(void *retval) {
 
   auto heap = ThreadLocalHeap::GetFastPathHeap();
   if (heap != nullptr) {
-    heap->releaseAll();
+    heap->park();
   }
 
   mesh::real::pthread_exit(retval);
@@ -182,14 +222,14 @@ void Runtime::createSignalFd() {
 #endif
 }
 
-void Runtime::startBgThread() {
+static void startBackgroundThread(PthreadFn threadFn) {
   constexpr int MaxRetries = 20;
 
   pthread_t bgPthread;
   int retryCount = 0;
   int ret = 0;
 
-  while ((ret = pthread_create(&bgPthread, nullptr, Runtime::bgThread, nullptr))) {
+  while ((ret = pthread_create(&bgPthread, nullptr, threadFn, nullptr))) {
     retryCount++;
     sched_yield();
 
@@ -203,6 +243,22 @@ void Runtime::startBgThread() {
   }
 }
 
+void Runtime::startBgThread() {
+  startBackgroundThread(Runtime::bgThread);
+}
+
+void Runtime::startMesherThread() {
+  if (!kMeshingEnabled) {
+    return;
+  }
+
+  startBackgroundThread(Runtime::mesherThread);
+}
+
+void *Runtime::mesherThread(void *arg) {
+  mesh::runtime().heap().backgroundMeshLoop();
+}
+
 void *Runtime::bgThread(void *arg) {
   auto &rt = mesh::runtime();
 
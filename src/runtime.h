@@ -40,6 +40,9 @@ public:
   }
 
   void startBgThread();
+  // mesh on a dedicated thread rather than on whichever application
+  // thread happens to free memory once the mesh period is up
+  void startMesherThread();
   void initMaxMapCount();
 
   // we need to wrap pthread_create and pthread_exit so that we can
@@ -93,6 +96,7 @@ private:
   static void segfaultHandler(int sig, siginfo_t *siginfo, void *context);
 
   static void *bgThread(void *arg);
+  static void *mesherThread(void *arg);
 
   friend Runtime &runtime();
 
@@ -248,6 +248,17 @@ public:
     return ptrFromOffset(off);
   }
 
+  // pop up to count objects at once, returning how many were popped
+  inline size_t ATTRIBUTE_ALWAYS_INLINE mallocBatch(void **ptrs, size_t count) {
+    const size_t n = min(count, static_cast<size_t>(length()));
+    for (size_t i = 0; i < n; i++) {
+      ptrs[i] = ptrFromOffset(_list[_off + i]);
+    }
+    _off += n;
+
+    return n;
+  }
+
   inline size_t getSize() {
     return _objectSize;
   }
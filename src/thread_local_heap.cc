@@ -15,7 +15,9 @@ ThreadLocalHeap *ThreadLocalHeap::CreateThreadLocalHeap() {
   hard_assert(buf != nullptr);
   hard_assert(reinterpret_cast<uintptr_t>(buf) % CACHELINE_SIZE == 0);
 
-  return new (buf) ThreadLocalHeap(&mesh::runtime().heap());
+  auto heap = new (buf) ThreadLocalHeap(&mesh::runtime().heap());
+  heap->adoptParked();
+  return heap;
 }
 
 void ThreadLocalHeap::releaseAll() {
@@ -23,6 +25,140 @@ void ThreadLocalHeap::releaseAll() {
     _shuffleVector[i].refillMiniheaps();
     _global->releaseMiniheaps(_shuffleVector[i].miniheaps());
   }
+
+  releaseLargeCache();
+}
+
+void ThreadLocalHeap::park() {
+  ParkedHeapPool::MiniHeapArray *miniheaps[kNumBins];
+  miniheaps[0] = &_shuffleVector[0].miniheaps();
+  for (size_t i = 1; i < kNumBins; i++) {
+    _shuffleVector[i].refillMiniheaps();
+    miniheaps[i] = &_shuffleVector[i].miniheaps();
+  }
+
+  releaseLargeCache();
+
+  if (!_global->parkMiniheaps(miniheaps)) {
+    releaseAll();
+  }
+}
+
+void ThreadLocalHeap::adoptParked() {
+  ParkedHeapPool::MiniHeapArray *miniheaps[kNumBins];
+  for (size_t i = 0; i < kNumBins; i++) {
+    miniheaps[i] = &_shuffleVector[i].miniheaps();
+  }
+
+  const pid_t id = _global->adoptMiniheaps(miniheaps);
+  if (id == 0) {
+    return;
+  }
+
+  // the adopted MiniHeaps are attached to id, so it becomes ours
+  _current = id;
+  for (size_t i = 1; i < kNumBins; i++) {
+    if (_shuffleVector[i].miniheaps().size() > 0) {
+      _shuffleVector[i].reinit();
+    }
+  }
+}
+
+void ThreadLocalHeap::releaseLargeCache() {
+  const auto arenaBegin = _global->arenaBegin();
+  for (size_t i = 0; i < kLargeCacheBinCount; i++) {
+    auto &bin = _largeCache[i];
+    while (bin.size > 0) {
+      MiniHeap *mh = bin.miniheaps[--bin.size];
+      _global->freeFor(mh, reinterpret_cast<void *>(mh->getSpanStart(arenaBegin)));
+    }
+  }
+  _largeCachePages = 0;
+}
+
+void *ThreadLocalHeap::largeCacheAlloc(size_t pageCount) {
+  if (pageCount > kLargeCacheMaxSpanPages) {
+    return nullptr;
+  }
+
+  auto &bin = _largeCache[pageCount - kLargeCacheMinPages];
+  if (bin.size == 0) {
+    return nullptr;
+  }
+
+  MiniHeap *mh = bin.miniheaps[--bin.size];
+  _largeCachePages -= pageCount;
+  d_assert(mh->isEmpty());
+  return mh->mallocAt(_global->arenaBegin(), 0);
+}
+
+void *ThreadLocalHeap::largeAlloc(size_t sz) {
+  void *ptr = largeCacheAlloc(PageCount(sz));
+  if (ptr != nullptr) {
+    return ptr;
+  }
+
+  return _global->malloc(sz);
+}
+
+void *ThreadLocalHeap::largeCalloc(size_t sz) {
+  // cached spans have been written to
+  void *ptr = largeCacheAlloc(PageCount(sz));
+  if (ptr != nullptr) {
+    memset(ptr, 0, sz);
+    return ptr;
+  }
+
+  return _global->calloc(sz);
+}
+
+// rather than freeing the span (and its MiniHeap) back to the global
+// heap, keep it around, still indexed, for the next large allocation
+// of the same page count.
+bool ThreadLocalHeap::largeCacheFree(MiniHeap *mh, void *ptr) {
+  const size_t pageCount = mh->spanSize() / kPageSize;
+  // e.g. page-aligned allocations of small sizes
+  if (pageCount < kLargeCacheMinPages || pageCount > kLargeCacheMaxSpanPages) {
+    return false;
+  }
+
+  const auto arenaBegin = _global->arenaBegin();
+  if (unlikely(reinterpret_cast<uintptr_t>(ptr) != mh->getSpanStart(arenaBegin))) {
+    return false;
+  }
+
+  auto &bin = _largeCache[pageCount - kLargeCacheMinPages];
+  if (bin.size >= kLargeCacheBinDepth || _largeCachePages + pageCount > kLargeCacheMaxPages) {
+    return false;
+  }
+
+  mh->free(arenaBegin, ptr);
+  bin.miniheaps[bin.size++] = mh;
+  _largeCachePages += pageCount;
+
+  return true;
+}
+
+CPULocalHeaps::Slot CPULocalHeaps::_slots[kMaxCPUHeaps];
+
+ThreadLocalHeap *CPULocalHeaps::CreateCPUHeap(int cpu) {
+  const size_t sz = RoundUpToPage(sizeof(ThreadLocalHeap));
+  void *buf = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  hard_assert(buf != MAP_FAILED);
+
+  return new (buf) ThreadLocalHeap(&mesh::runtime().heap(), kCPUHeapIDBase + cpu);
+}
+
+void CPULocalHeaps::lock() {
+  for (size_t i = 0; i < kMaxCPUHeaps; i++) {
+    _slots[i].lock.lock();
+  }
+}
+
+void CPULocalHeaps::unlock() {
+  for (size_t i = kMaxCPUHeaps; i > 0; i--) {
+    _slots[i - 1].lock.unlock();
+  }
 }
 
 ThreadLocalHeap *ThreadLocalHeap::GetHeap() {
@@ -34,6 +170,65 @@ ThreadLocalHeap *ThreadLocalHeap::GetHeap() {
   return heap;
 }
 
+size_t ThreadLocalHeap::mallocBatch(size_t sz, void **ptrs, size_t count) {
+  uint32_t sizeClass = 0;
+
+  if (unlikely(!SizeMap::GetSizeClass(sz, &sizeClass))) {
+    for (size_t i = 0; i < count; i++) {
+      ptrs[i] = _global->malloc(sz);
+      if (unlikely(ptrs[i] == nullptr)) {
+        return i;
+      }
+    }
+    return count;
+  }
+
+  ShuffleVector &shuffleVector = _shuffleVector[sizeClass];
+  size_t allocated = 0;
+  while (allocated < count) {
+    if (unlikely(shuffleVector.isExhausted())) {
+      ptrs[allocated] = smallAllocSlowpath(sizeClass);
+      allocated++;
+      continue;
+    }
+    allocated += shuffleVector.mallocBatch(&ptrs[allocated], count - allocated);
+  }
+
+  return allocated;
+}
+
+void ThreadLocalHeap::freeBatch(void **ptrs, size_t count) {
+  const auto arenaBegin = _global->arenaBegin();
+
+  // the MiniHeap of the last pointer we freed locally, and its span.
+  // It is attached to us, so it can't be freed or meshed away while
+  // we work through the batch.
+  MiniHeap *mh = nullptr;
+  uintptr_t spanBegin = 0;
+  uintptr_t spanEnd = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    void *ptr = ptrs[i];
+    if (unlikely(ptr == nullptr)) {
+      continue;
+    }
+
+    const auto ptrval = reinterpret_cast<uintptr_t>(ptr);
+    if (mh == nullptr || ptrval < spanBegin || ptrval >= spanEnd) {
+      mh = _global->miniheapFor(ptr, _pageMapCache);
+      if (unlikely(!(mh && mh->current() == _current && !mh->hasMeshed()))) {
+        _global->freeFor(mh, ptr);
+        mh = nullptr;
+        continue;
+      }
+      spanBegin = mh->getSpanStart(arenaBegin);
+      spanEnd = spanBegin + mh->spanSize();
+    }
+
+    _shuffleVector[mh->sizeClass()].free(mh, ptr);
+  }
+}
+
 // we get here if the shuffleVector is exhausted
 void *CACHELINE_ALIGNED_FN ThreadLocalHeap::smallAllocSlowpath(size_t sizeClass) {
   ShuffleVector &shuffleVector = _shuffleVector[sizeClass];
@@ -28,8 +28,25 @@
 
 using namespace HL;
 
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define MESH_HAVE_RSEQ 1
+extern "C" {
+// exported by glibc 2.35+, which registers an rseq area for every
+// thread.  Weak so that we still link against older C libraries.
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+}
+#endif
+
 namespace mesh {
 
+// recently freed single-object MiniHeaps, binned by page count
+class LargeCacheBin {
+public:
+  uint32_t size{0};
+  MiniHeap *miniheaps[kLargeCacheBinDepth];
+};
+
 class LocalHeapStats {
 public:
   atomic_size_t allocCount{0};
@@ -43,9 +60,11 @@ private:
 public:
   enum { Alignment = 16 };
 
-  ThreadLocalHeap(GlobalHeap *global)
+  // current is the id MiniHeaps are attached with: our tid, or for
+  // per-CPU heaps a synthetic id
+  ThreadLocalHeap(GlobalHeap *global, pid_t current = gettid())
       : _global(global),
-        _current(gettid()),
+        _current(current),
         _prng(internal::seed(), internal::seed()),
         _maxObjectSize(SizeMap::ByteSizeForClass(kNumBins - 1)) {
     const auto arenaBegin = _global->arenaBegin();
@@ -63,6 +82,12 @@ public:
 
   void releaseAll();
 
+  // on thread exit: park our partially free MiniHeaps for the next new
+  // thread to adopt, or release them if the pool is full
+  void park();
+  // called on a new heap: take over a parked heap's MiniHeaps
+  void adoptParked();
+
   void *ATTRIBUTE_NEVER_INLINE CACHELINE_ALIGNED_FN smallAllocSlowpath(size_t sizeClass);
   void *ATTRIBUTE_NEVER_INLINE CACHELINE_ALIGNED_FN smallAllocGlobalRefill(ShuffleVector &shuffleVector,
                                                                            size_t sizeClass);
@@ -84,15 +109,20 @@ public:
       auto ptr = this->malloc(size);
       d_assert_msg((reinterpret_cast<uintptr_t>(ptr) % alignment) == 0, "%p(%zu) %% %zu != 0", ptr, size, alignment);
       return ptr;
-    } else if (isSmall) {
-      const auto sizeClassBytes = SizeMap::ByteSizeForClass(sizeClass);
-      // if the alignment is for a small allocation that is less than
-      // the page size, and the size class size in bytes is a multiple
-      // of the alignment, just call malloc
-      if (sizeClassBytes <= kPageSize && alignment <= sizeClassBytes && (sizeClassBytes % alignment) == 0) {
-        auto ptr = this->malloc(size);
-        d_assert_msg((reinterpret_cast<uintptr_t>(ptr) % alignment) == 0, "%p(%zu) %% %zu != 0", ptr, size, alignment);
-        return ptr;
+    } else if (isSmall && alignment <= kPageSize) {
+      // objects are laid out back to back from the (page-aligned)
+      // start of their span, so every object in a size class whose
+      // size is a multiple of the alignment is suitably aligned.
+      // Find the smallest such class that fits -- e.g. 128 for
+      // aligned_alloc(64, 96) -- and stay on the fast path.
+      for (; sizeClass < static_cast<uint32_t>(kNumBins); sizeClass++) {
+        const auto sizeClassBytes = SizeMap::ByteSizeForClass(sizeClass);
+        if (sizeClassBytes >= size && (sizeClassBytes % alignment) == 0) {
+          auto ptr = this->malloc(sizeClassBytes);
+          d_assert_msg((reinterpret_cast<uintptr_t>(ptr) % alignment) == 0, "%p(%zu) %% %zu != 0", ptr, size,
+                       alignment);
+          return ptr;
+        }
       }
     }
 
@@ -119,6 +149,17 @@ public:
     const size_t lowerBoundToGrow = oldSize + oldSize / 4ul;
     const size_t upperBoundToShrink = oldSize / 2ul;
 
+    // large allocations can often grow into the free pages that
+    // follow them, avoiding the copy
+    if (newSize > oldSize && oldSize > kMaxSize) {
+      if (newSize < lowerBoundToGrow && _global->growInPlace(oldPtr, lowerBoundToGrow)) {
+        return oldPtr;
+      }
+      if (_global->growInPlace(oldPtr, newSize)) {
+        return oldPtr;
+      }
+    }
+
     if (newSize > oldSize || newSize < upperBoundToShrink) {
       void *newPtr = nullptr;
       if (newSize > oldSize && newSize < lowerBoundToGrow) {
@@ -147,6 +188,12 @@ public:
     }
 
     const size_t n = count * size;
+
+    uint32_t sizeClass = 0;
+    if (unlikely(!SizeMap::GetSizeClass(n, &sizeClass))) {
+      return largeCalloc(n);
+    }
+
     void *ptr = this->malloc(n);
 
     if (ptr != nullptr) {
@@ -171,7 +218,7 @@ public:
 
     // if the size isn't in our sizemap it is a large alloc
     if (unlikely(!SizeMap::GetSizeClass(sz, &sizeClass))) {
-      return _global->malloc(sz);
+      return largeAlloc(sz);
     }
 
     ShuffleVector &shuffleVector = _shuffleVector[sizeClass];
@@ -186,12 +233,15 @@ public:
     if (unlikely(ptr == nullptr))
       return;
 
-    auto mh = _global->miniheapFor(ptr);
+    auto mh = _global->miniheapFor(ptr, _pageMapCache);
     if (likely(mh && mh->current() == _current && !mh->hasMeshed())) {
       ShuffleVector &shuffleVector = _shuffleVector[mh->sizeClass()];
       shuffleVector.free(mh, ptr);
       return;
     }
+    if (unlikely(mh && mh->maxCount() == 1) && largeCacheFree(mh, ptr)) {
+      return;
+    }
     _global->freeFor(mh, ptr);
   }
 
@@ -199,11 +249,18 @@ public:
     this->free(ptr);
   }
 
+  // allocate count objects of sz bytes into ptrs, returning how many
+  // were allocated
+  size_t mallocBatch(size_t sz, void **ptrs, size_t count);
+  // free count pointers (nullptrs are skipped), looking up the
+  // MiniHeap only when a pointer falls outside the previous one's span
+  void freeBatch(void **ptrs, size_t count);
+
   inline size_t getSize(void *ptr) {
     if (unlikely(ptr == nullptr))
       return 0;
 
-    auto mh = _global->miniheapFor(ptr);
+    auto mh = _global->miniheapFor(ptr, _pageMapCache);
     if (likely(mh && mh->current() == _current)) {
       ShuffleVector &shuffleVector = _shuffleVector[mh->sizeClass()];
       return shuffleVector.getSize();
@@ -212,6 +269,14 @@ public:
     return _global->getSize(ptr);
   }
 
+  // large allocations, served from or returned to our large cache
+  // when possible
+  void *ATTRIBUTE_NEVER_INLINE largeAlloc(size_t sz);
+  void *ATTRIBUTE_NEVER_INLINE largeCalloc(size_t sz);
+  void *largeCacheAlloc(size_t pageCount);
+  bool ATTRIBUTE_NEVER_INLINE largeCacheFree(MiniHeap *mh, void *ptr);
+  void releaseLargeCache();
+
   static inline ThreadLocalHeap *GetFastPathHeap() {
     return _threadLocalData.fastpathHeap;
   }
@@ -234,15 +299,84 @@ protected:
   ShuffleVector _shuffleVector[kNumBins] CACHELINE_ALIGNED;
   GlobalHeap *_global;
   pid_t _current{0};
+  PageMap::Cache _pageMapCache{};
   MWC _prng;
   const size_t _maxObjectSize;
   LocalHeapStats _stats{};
+  LargeCacheBin _largeCache[kLargeCacheBinCount]{};
+  size_t _largeCachePages{0};
 
   struct ThreadLocalData {
     ThreadLocalHeap *fastpathHeap;
   };
   static __thread ThreadLocalData _threadLocalData CACHELINE_ALIGNED ATTR_INITIAL_EXEC;
 };
+
+// With per-CPU heaps (./configure --per-cpu-heaps) threads share one
+// ThreadLocalHeap per CPU instead of each getting their own, bounding
+// the number of attached, non-meshable MiniHeaps by the CPU count.
+// The CPU is read from the rseq area the C library registers for
+// each thread; a thread can be preempted or migrate mid-operation, so
+// every heap also has an (almost always uncontended) lock.  Threads
+// without an rseq registration use their own ThreadLocalHeap.
+class CPULocalHeaps {
+private:
+  DISALLOW_COPY_AND_ASSIGN(CPULocalHeaps);
+
+public:
+  // the CPU the calling thread is running on, or -1 if rseq isn't
+  // registered for it
+  static inline int ATTRIBUTE_ALWAYS_INLINE CurrentCPU() {
+#ifdef MESH_HAVE_RSEQ
+    if (unlikely(&__rseq_size == nullptr || __rseq_size == 0)) {
+      return -1;
+    }
+
+    char *tp;
+#if defined(__x86_64__)
+    asm("mov %%fs:0, %0" : "=r"(tp));
+#else
+    asm("mrs %0, tpidr_el0" : "=r"(tp));
+#endif
+    // struct rseq { u32 cpu_id_start; u32 cpu_id; ... } -- cpu_id is
+    // negative until registration succeeds
+    const auto cpuId = reinterpret_cast<volatile int32_t *>(tp + __rseq_offset + sizeof(uint32_t));
+    return *cpuId;
+#else
+    return -1;
+#endif
+  }
+
+  template <typename Fn>
+  static inline auto ATTRIBUTE_ALWAYS_INLINE WithHeap(Fn fn) -> decltype(fn(static_cast<ThreadLocalHeap *>(nullptr))) {
+    const int cpu = CurrentCPU();
+    if (unlikely(cpu < 0 || static_cast<size_t>(cpu) >= kMaxCPUHeaps)) {
+      return fn(ThreadLocalHeap::GetHeap());
+    }
+
+    Slot &slot = _slots[cpu];
+    lock_guard<mutex> lock(slot.lock);
+    if (unlikely(slot.heap == nullptr)) {
+      slot.heap = CreateCPUHeap(cpu);
+    }
+
+    return fn(slot.heap);
+  }
+
+  // used to quiesce allocation around fork
+  static void lock();
+  static void unlock();
+
+private:
+  struct CACHELINE_ALIGNED Slot {
+    mutex lock{};
+    ThreadLocalHeap *heap{nullptr};
+  };
+
+  static ATTRIBUTE_NEVER_INLINE ThreadLocalHeap *CreateCPUHeap(int cpu);
+
+  static Slot _slots[kMaxCPUHeaps];
+};
 }  // namespace mesh
 
 #endif  // MESH__THREAD_LOCAL_HEAP_H
@@ -0,0 +1,85 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__TRANSFER_CACHE_H
+#define MESH__TRANSFER_CACHE_H
+
+#include <atomic>
+
+#include "common.h"
+#include "mini_heap.h"
+
+namespace mesh {
+
+// A small, lock-free set of partially free MiniHeaps for a single size
+// class.  Thread-local heaps park MiniHeaps they give up here, and
+// take them back out on refill, with a single CAS each -- without
+// going through the size class lock or the BinnedTracker.
+//
+// Cached MiniHeaps stay attached (to kTransferCacheID), so they are
+// neither rebinned by remote frees nor considered for meshing until
+// the cache is drained.
+class TransferCache {
+private:
+  DISALLOW_COPY_AND_ASSIGN(TransferCache);
+
+public:
+  TransferCache() {
+  }
+
+  // returns false if the cache is full
+  inline bool put(MiniHeap *mh) {
+    d_assert(mh != nullptr);
+    d_assert(mh->current() == kTransferCacheID);
+
+    for (size_t i = 0; i < kTransferCacheSize; i++) {
+      if (_slots[i].load(std::memory_order_relaxed) != nullptr) {
+        continue;
+      }
+      MiniHeap *expected = nullptr;
+      if (_slots[i].compare_exchange_strong(expected, mh, std::memory_order_release, std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // returns nullptr if the cache is empty.  With node >= 0, only
+  // miniheaps on that memory node are taken.
+  inline MiniHeap *take(int node = -1) {
+    for (size_t i = 0; i < kTransferCacheSize; i++) {
+      MiniHeap *mh = _slots[i].load(std::memory_order_relaxed);
+      if (mh == nullptr) {
+        continue;
+      }
+      if (node < 0) {
+        mh = _slots[i].exchange(nullptr, std::memory_order_acquire);
+        if (mh != nullptr) {
+          return mh;
+        }
+        continue;
+      }
+
+      // mh may be taken (and even freed) as we look at it, in which
+      // case its node is garbage and the exchange below fails
+      if (mh->numaNode() != static_cast<uint32_t>(node)) {
+        continue;
+      }
+      if (_slots[i].compare_exchange_strong(mh, nullptr, std::memory_order_acquire, std::memory_order_relaxed)) {
+        return mh;
+      }
+    }
+
+    return nullptr;
+  }
+
+private:
+  atomic<MiniHeap *> _slots[kTransferCacheSize]{};
+};
+}  // namespace mesh
+
+#endif  // MESH__TRANSFER_CACHE_H
@@ -0,0 +1,60 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <cstdint>
+#include <cstring>
+#include <set>
+
+#include "gtest/gtest.h"
+
+#include "common.h"
+#include "internal.h"
+#include "thread_local_heap.h"
+
+using namespace mesh;
+
+static constexpr size_t BatchCount = 1000;
+
+static void testBatch(size_t sz) {
+  auto heap = ThreadLocalHeap::GetHeap();
+
+  void **ptrs = reinterpret_cast<void **>(calloc(BatchCount, sizeof(void *)));
+  ASSERT_EQ(heap->mallocBatch(sz, ptrs, BatchCount), BatchCount);
+
+  std::set<void *> unique{};
+  for (size_t i = 0; i < BatchCount; i++) {
+    ASSERT_NE(ptrs[i], nullptr);
+    ASSERT_GE(heap->getSize(ptrs[i]), sz);
+    memset(ptrs[i], 'a', sz);
+    unique.insert(ptrs[i]);
+  }
+  ASSERT_EQ(unique.size(), BatchCount);
+
+  // nullptrs in a batch are skipped
+  void *skipped = ptrs[BatchCount / 2];
+  ptrs[BatchCount / 2] = nullptr;
+
+  heap->freeBatch(ptrs, BatchCount);
+  heap->free(skipped);
+  free(ptrs);
+
+  heap->releaseAll();
+  mesh::runtime().heap().flushAllBins();
+}
+
+TEST(Batch, Small) {
+  testBatch(16);
+  testBatch(48);
+}
+
+TEST(Batch, MultiplePages) {
+  testBatch(2048);
+}
+
+TEST(Batch, Large) {
+  const auto before = mesh::runtime().heap().getAllocatedMiniheapCount();
+  testBatch(kMaxSize + 1);
+  ASSERT_EQ(mesh::runtime().heap().getAllocatedMiniheapCount(), before);
+}
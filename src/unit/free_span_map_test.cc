@@ -0,0 +1,107 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <cstdint>
+
+#include "gtest/gtest.h"
+
+#include "free_span_map.h"
+
+using namespace mesh;
+
+TEST(FreeSpanMap, BestFit) {
+  FreeSpanMap spans{};
+
+  spans.add(Span(0, 8));
+  spans.add(Span(100, 3));
+  spans.add(Span(200, 300));
+  spans.add(Span(600, 3));
+  ASSERT_EQ(spans.size(), 4UL);
+  ASSERT_EQ(spans.pageCount(), 314UL);
+
+  // the shortest span that fits, lowest offset first
+  Span result(0, 0);
+  ASSERT_TRUE(spans.takeBestFit(2, result));
+  ASSERT_EQ(result.offset, 100U);
+  ASSERT_EQ(result.length, 2U);
+
+  // the leftover page is still free
+  ASSERT_TRUE(spans.takeBestFit(1, result));
+  ASSERT_EQ(result.offset, 102U);
+  ASSERT_TRUE(spans.takeBestFit(3, result));
+  ASSERT_EQ(result.offset, 600U);
+  ASSERT_TRUE(spans.takeBestFit(8, result));
+  ASSERT_EQ(result.offset, 0U);
+
+  ASSERT_FALSE(spans.takeBestFit(301, result));
+  ASSERT_TRUE(spans.takeBestFit(256, result));
+  ASSERT_EQ(result.offset, 200U);
+  ASSERT_EQ(spans.pageCount(), 44UL);
+}
+
+TEST(FreeSpanMap, Coalesce) {
+  FreeSpanMap spans{};
+
+  spans.add(Span(10, 5));
+  spans.add(Span(20, 5));
+  ASSERT_EQ(spans.size(), 2UL);
+
+  // filling the gap joins all three
+  spans.add(Span(15, 5));
+  ASSERT_EQ(spans.size(), 1UL);
+  spans.add(Span(5, 5));
+  spans.add(Span(25, 1));
+  ASSERT_EQ(spans.size(), 1UL);
+  ASSERT_EQ(spans.pageCount(), 21UL);
+
+  Span result(0, 0);
+  ASSERT_TRUE(spans.takeBestFit(21, result));
+  ASSERT_EQ(result.offset, 5U);
+  ASSERT_EQ(result.length, 21U);
+  ASSERT_TRUE(spans.empty());
+}
+
+TEST(FreeSpanMap, TakeAt) {
+  FreeSpanMap spans{};
+
+  spans.add(Span(10, 10));
+
+  // only spans starting exactly at the offset can be taken
+  ASSERT_FALSE(spans.takeAt(11, 1));
+  ASSERT_FALSE(spans.takeAt(10, 11));
+  ASSERT_TRUE(spans.takeAt(10, 4));
+  ASSERT_TRUE(spans.takeAt(14, 6));
+  ASSERT_TRUE(spans.empty());
+}
+
+TEST(FreeSpanMap, TakeOlderThan) {
+  FreeSpanMap spans{};
+
+  spans.add(Span(0, 4), 1);
+  spans.add(Span(10, 4), 3);
+  spans.add(Span(20, 4), 5);
+  // a coalesced span is as young as its newest part
+  spans.add(Span(4, 2), 4);
+  ASSERT_EQ(spans.size(), 3UL);
+
+  size_t taken = 0;
+  spans.takeOlderThan(6, 3, [&](const Span &span) {
+    ASSERT_EQ(span.offset, 10U);
+    taken += span.length;
+  });
+  ASSERT_EQ(taken, 4UL);
+  ASSERT_EQ(spans.pageCount(), 10UL);
+
+  spans.takeOlderThan(6, 1, [&](const Span &span) { taken += span.length; });
+  ASSERT_EQ(taken, 14UL);
+  ASSERT_TRUE(spans.empty());
+
+  // epochs may wrap around
+  spans.add(Span(0, 4), 0xffffffff);
+  spans.takeOlderThan(1, 3, [&](const Span &span) { taken += span.length; });
+  ASSERT_EQ(taken, 14UL);
+  spans.takeOlderThan(1, 2, [&](const Span &span) { taken += span.length; });
+  ASSERT_EQ(taken, 18UL);
+}
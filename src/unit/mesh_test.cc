@@ -4,11 +4,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <algorithm>
+
 #include "gtest/gtest.h"
 
 #include "internal.h"
 #include "meshing.h"
 #include "runtime.h"
+#include "thread_local_heap.h"
 
 using namespace mesh;
 
@@ -141,3 +144,406 @@ TEST(MeshTest, TryMesh) {
 TEST(MeshTest, TryMeshInverse) {
   meshTest(true);
 }
+
+TEST(MeshTest, MeshableMask) {
+  MWC prng(internal::seed(), internal::seed());
+
+  static constexpr size_t Count = kernel::kMaxMaskCandidates;
+  PackedBitmap candidates[Count];
+  for (size_t trial = 0; trial < 100; trial++) {
+    // sparse bitmaps, so that some pairs are meshable
+    PackedBitmap bitmap{};
+    for (size_t k = 0; k < 8; k++) {
+      const auto bit = prng.inRange(0, 255);
+      bitmap.bits[bit / 64] |= static_cast<uint64_t>(1) << (bit % 64);
+    }
+    for (size_t i = 0; i < Count; i++) {
+      candidates[i] = PackedBitmap{};
+      for (size_t k = 0; k < 8; k++) {
+        const auto bit = prng.inRange(0, 255);
+        candidates[i].bits[bit / 64] |= static_cast<uint64_t>(1) << (bit % 64);
+      }
+    }
+
+    for (size_t count = 0; count <= Count; count += 7) {
+      const uint64_t expected = kernel::meshableMaskScalar(bitmap, candidates, count);
+      for (size_t i = 0; i < count; i++) {
+        uint64_t overlap = 0;
+        for (size_t w = 0; w < PackedBitmap::kWords; w++) {
+          overlap |= bitmap.bits[w] & candidates[i].bits[w];
+        }
+        ASSERT_EQ((expected >> i) & 1, overlap == 0 ? 1U : 0U);
+      }
+      ASSERT_EQ(meshableMask(bitmap, candidates, count), expected);
+#if defined(__x86_64__)
+      ASSERT_EQ(kernel::meshableMaskSSE2(bitmap, candidates, count), expected);
+      if (__builtin_cpu_supports("avx")) {
+        ASSERT_EQ(kernel::meshableMaskAVX(bitmap, candidates, count), expected);
+      }
+      if (__builtin_cpu_supports("avx512f")) {
+        ASSERT_EQ(kernel::meshableMaskAVX512(bitmap, candidates, count), expected);
+      }
+#endif
+    }
+  }
+}
+
+TEST(MeshTest, GreedyMatching) {
+  if (!kMeshingEnabled) {
+    GTEST_SKIP();
+  }
+
+  const auto tid = gettid();
+  GlobalHeap &gheap = runtime().heap();
+  gheap.setMeshPeriodMs(kZeroMs);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+
+  // miniheap i has object i % ObjCount allocated, so any two with
+  // different i % ObjCount mesh
+  static constexpr size_t Count = 2 * ObjCount;
+  internal::vector<MiniHeap *> candidates{};
+  internal::vector<void *> ptrs{};
+  for (size_t i = 0; i < Count; i++) {
+    FixedArray<MiniHeap, 1> array{};
+    gheap.allocSmallMiniheaps(SizeMap::SizeClass(StrLen), StrLen, array, tid);
+    MiniHeap *mh = array[0];
+    ptrs.push_back(mh->mallocAt(gheap.arenaBegin(), i % ObjCount));
+    mh->unsetAttached();
+    candidates.push_back(mh);
+  }
+
+  MWC prng(internal::seed(), internal::seed());
+  internal::vector<std::pair<MiniHeap *, MiniHeap *>> pairs{};
+  method::greedyMatching(prng, candidates, [&](std::pair<MiniHeap *, MiniHeap *> &&heaps) {
+    pairs.push_back(std::move(heaps));
+  });
+
+  // everything is paired up -- except possibly the last two, if they
+  // have the same object allocated -- and each miniheap at most once
+  ASSERT_GE(pairs.size(), Count / 2 - 1);
+  internal::vector<MiniHeap *> seen{};
+  for (auto &pair : pairs) {
+    auto mh1 = std::get<0>(pair);
+    auto mh2 = std::get<1>(pair);
+    ASSERT_TRUE(mesh::bitmapsMeshable(mh1->bitmap().bits(), mh2->bitmap().bits(), mh1->bitmap().byteCount()));
+    seen.push_back(mh1);
+    seen.push_back(mh2);
+  }
+  std::sort(seen.begin(), seen.end());
+  ASSERT_EQ(std::unique(seen.begin(), seen.end()), seen.end());
+
+  for (auto ptr : ptrs) {
+    gheap.free(ptr);
+  }
+  gheap.flushAllBins();
+  gheap.scavenge(true);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+}
+
+TEST(MeshTest, GreedyMatchingBestFit) {
+  if (!kMeshingEnabled) {
+    GTEST_SKIP();
+  }
+
+  const auto tid = gettid();
+  GlobalHeap &gheap = runtime().heap();
+  gheap.setMeshPeriodMs(kZeroMs);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+
+  // empty has object 0 allocated, and meshes with both others; of
+  // those, full (objects 1..Full) is the better fit than sparse
+  // (objects 1 and 2)
+  static constexpr size_t Full = ObjCount / 2;
+  internal::vector<void *> ptrs{};
+  MiniHeap *miniheaps[3];
+  const size_t counts[3] = {1, 2, Full};
+  for (size_t i = 0; i < 3; i++) {
+    FixedArray<MiniHeap, 1> array{};
+    gheap.allocSmallMiniheaps(SizeMap::SizeClass(StrLen), StrLen, array, tid);
+    miniheaps[i] = array[0];
+    for (size_t off = 0; off < counts[i]; off++) {
+      ptrs.push_back(miniheaps[i]->mallocAt(gheap.arenaBegin(), i == 0 ? 0 : off + 1));
+    }
+    miniheaps[i]->unsetAttached();
+  }
+  MiniHeap *empty = miniheaps[0];
+  MiniHeap *full = miniheaps[2];
+
+  internal::vector<MiniHeap *> candidates{miniheaps[2], miniheaps[0], miniheaps[1]};
+  MWC prng(internal::seed(), internal::seed());
+  internal::vector<std::pair<MiniHeap *, MiniHeap *>> pairs{};
+  method::greedyMatching(prng, candidates, [&](std::pair<MiniHeap *, MiniHeap *> &&heaps) {
+    pairs.push_back(std::move(heaps));
+  });
+
+  ASSERT_EQ(pairs.size(), 1UL);
+  ASSERT_EQ(std::get<0>(pairs[0]), empty);
+  ASSERT_EQ(std::get<1>(pairs[0]), full);
+
+  for (auto ptr : ptrs) {
+    gheap.free(ptr);
+  }
+  gheap.flushAllBins();
+  gheap.scavenge(true);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+}
+
+TEST(MeshTest, MultiWayMatching) {
+  if (!kMeshingEnabled) {
+    GTEST_SKIP();
+  }
+
+  const auto tid = gettid();
+  GlobalHeap &gheap = runtime().heap();
+  gheap.setMeshPeriodMs(kZeroMs);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+
+  // miniheap i has object i allocated, so all of them mesh with each
+  // other and form a single group
+  internal::vector<MiniHeap *> candidates{};
+  internal::vector<void *> ptrs{};
+  for (size_t i = 0; i < kMeshGroupSize; i++) {
+    FixedArray<MiniHeap, 1> array{};
+    gheap.allocSmallMiniheaps(SizeMap::SizeClass(StrLen), StrLen, array, tid);
+    MiniHeap *mh = array[0];
+    ptrs.push_back(mh->mallocAt(gheap.arenaBegin(), i));
+    mh->unsetAttached();
+    candidates.push_back(mh);
+  }
+
+  MWC prng(internal::seed(), internal::seed());
+  internal::vector<std::pair<MiniHeap *, MiniHeap *>> pairs{};
+  method::multiWayMatching(prng, candidates, [&](std::pair<MiniHeap *, MiniHeap *> &&heaps) {
+    pairs.push_back(std::move(heaps));
+  });
+
+  ASSERT_EQ(pairs.size(), kMeshGroupSize - 1);
+  internal::vector<MiniHeap *> seen{std::get<0>(pairs[0])};
+  for (auto &pair : pairs) {
+    ASSERT_EQ(std::get<0>(pair), std::get<0>(pairs[0]));
+    seen.push_back(std::get<1>(pair));
+  }
+  std::sort(seen.begin(), seen.end());
+  ASSERT_EQ(std::unique(seen.begin(), seen.end()), seen.end());
+
+  for (auto ptr : ptrs) {
+    gheap.free(ptr);
+  }
+  gheap.flushAllBins();
+  gheap.scavenge(true);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+}
+
+TEST(MeshTest, MultiWayCompact) {
+  if (!kMeshingEnabled) {
+    GTEST_SKIP();
+  }
+
+  GlobalHeap &gheap = runtime().heap();
+  gheap.setMeshPeriodMs(kZeroMs);
+  gheap.flushAllBins();
+
+  auto heap = ThreadLocalHeap::GetHeap();
+
+  static constexpr size_t Sz = 256;
+  internal::vector<char *> ptrs{};
+  for (size_t i = 0; i < 64 * kPageSize / Sz; i++) {
+    ptrs.push_back(reinterpret_cast<char *>(heap->malloc(Sz)));
+  }
+  heap->releaseAll();
+
+  internal::vector<char *> live{};
+  for (size_t i = 0; i < ptrs.size(); i++) {
+    if (i % 11 == 0) {
+      memset(ptrs[i], static_cast<int>(live.size() % 251), Sz);
+      live.push_back(ptrs[i]);
+    } else {
+      gheap.free(ptrs[i]);
+    }
+  }
+
+  auto spanCount = [&]() {
+    internal::vector<MiniHeap *> miniheaps{};
+    for (auto ptr : live) {
+      miniheaps.push_back(gheap.miniheapFor(ptr));
+    }
+    std::sort(miniheaps.begin(), miniheaps.end());
+    return std::unique(miniheaps.begin(), miniheaps.end()) - miniheaps.begin();
+  };
+  const auto before = spanCount();
+
+  size_t method = static_cast<size_t>(MeshMethod::MultiWay);
+  size_t oldMethod = 0;
+  size_t len = sizeof(oldMethod);
+  ASSERT_EQ(gheap.mallctl("mesh.method", &oldMethod, &len, &method, sizeof(method)), 0);
+  size_t unused = 0;
+  size_t workers = 1;
+  ASSERT_EQ(gheap.mallctl("mesh.compact", &unused, &len, &workers, sizeof(workers)), 0);
+  ASSERT_EQ(gheap.mallctl("mesh.method", &method, &len, &oldMethod, sizeof(oldMethod)), 0);
+
+  // meshing in pairs could at best halve the number of spans in one
+  // pass
+  ASSERT_LT(spanCount(), before / 2);
+
+  for (size_t i = 0; i < live.size(); i++) {
+    const auto ptr = live[i];
+    for (size_t j = 0; j < Sz; j++) {
+      ASSERT_EQ(ptr[j], static_cast<char>(i % 251));
+    }
+    gheap.free(ptr);
+  }
+  gheap.flushAllBins();
+}
+
+TEST(MeshTest, SameNodeOnly) {
+  if (!kMeshingEnabled) {
+    GTEST_SKIP();
+  }
+
+  GlobalHeap &gheap = runtime().heap();
+  gheap.setMeshPeriodMs(kZeroMs);
+  gheap.flushAllBins();
+
+  auto heap = ThreadLocalHeap::GetHeap();
+
+  static constexpr size_t Sz = 256;
+  internal::vector<char *> ptrs{};
+  for (size_t i = 0; i < 64 * kPageSize / Sz; i++) {
+    ptrs.push_back(reinterpret_cast<char *>(heap->malloc(Sz)));
+  }
+  heap->releaseAll();
+
+  // pretend every other span is on a second node
+  internal::vector<char *> live{};
+  internal::vector<uint32_t> nodes{};
+  MiniHeap *last = nullptr;
+  uint32_t node = 1;
+  for (size_t i = 0; i < ptrs.size(); i++) {
+    MiniHeap *mh = gheap.miniheapFor(ptrs[i]);
+    if (mh != last) {
+      node = 1 - node;
+      mh->setNumaNode(node);
+      last = mh;
+    }
+    if (i % 11 == 0) {
+      live.push_back(ptrs[i]);
+      nodes.push_back(node);
+    } else {
+      gheap.free(ptrs[i]);
+    }
+  }
+
+  size_t unused = 0;
+  size_t len = sizeof(unused);
+  size_t workers = 1;
+  ASSERT_EQ(gheap.mallctl("mesh.compact", &unused, &len, &workers, sizeof(workers)), 0);
+
+  // spans were meshed, but no object moved to the other node
+  size_t meshed = 0;
+  for (size_t i = 0; i < live.size(); i++) {
+    MiniHeap *mh = gheap.miniheapFor(live[i]);
+    ASSERT_EQ(mh->numaNode(), nodes[i]);
+    meshed += mh->meshCount() > 1;
+  }
+  ASSERT_GT(meshed, 0UL);
+
+  for (auto ptr : live) {
+    gheap.free(ptr);
+  }
+  gheap.flushAllBins();
+}
+
+TEST(MeshTest, AdaptiveSchedule) {
+  if (!kMeshingEnabled) {
+    GTEST_SKIP();
+  }
+
+  GlobalHeap &gheap = runtime().heap();
+  gheap.setMeshPeriodMs(std::chrono::milliseconds(100));
+  gheap.flushAllBins();
+
+  size_t interval = 0;
+  size_t len = sizeof(interval);
+  ASSERT_EQ(gheap.mallctl("mesh.interval_ms", &interval, &len, nullptr, 0), 0);
+  ASSERT_EQ(interval, 100UL);
+
+  // with nothing to mesh, every pass is unproductive, and the period
+  // backs off to its cap
+  size_t workers = 1;
+  for (int i = 0; i < kMaxMeshBackoff + 2; i++) {
+    ASSERT_EQ(gheap.mallctl("mesh.compact", &interval, &len, &workers, sizeof(workers)), 0);
+  }
+  ASSERT_EQ(gheap.mallctl("mesh.interval_ms", &interval, &len, nullptr, 0), 0);
+  ASSERT_EQ(interval, 100UL << kMaxMeshBackoff);
+
+  // turning adaptation off goes back to the base period
+  size_t adaptive = 0;
+  ASSERT_EQ(gheap.mallctl("mesh.adaptive", &interval, &len, &adaptive, sizeof(adaptive)), 0);
+  ASSERT_EQ(gheap.mallctl("mesh.compact", &interval, &len, &workers, sizeof(workers)), 0);
+  ASSERT_EQ(gheap.mallctl("mesh.interval_ms", &interval, &len, nullptr, 0), 0);
+  ASSERT_EQ(interval, 100UL);
+
+  adaptive = 1;
+  ASSERT_EQ(gheap.mallctl("mesh.adaptive", &interval, &len, &adaptive, sizeof(adaptive)), 0);
+  gheap.setMeshPeriodMs(kZeroMs);
+}
+
+TEST(MeshTest, ParallelCompact) {
+  if (!kMeshingEnabled) {
+    GTEST_SKIP();
+  }
+
+  GlobalHeap &gheap = runtime().heap();
+  gheap.setMeshPeriodMs(kZeroMs);
+  gheap.flushAllBins();
+
+  auto heap = ThreadLocalHeap::GetHeap();
+
+  // sparsely fill miniheaps in several size classes at once, so that
+  // more than one worker has something to mesh
+  static constexpr size_t Sizes[] = {16, 64, 256, 1024};
+  static constexpr size_t BytesPerSize = 64 * kPageSize;
+  internal::vector<std::pair<char *, size_t>> ptrs{};
+  for (auto sz : Sizes) {
+    for (size_t i = 0; i < BytesPerSize / sz; i++) {
+      ptrs.push_back({reinterpret_cast<char *>(heap->malloc(sz)), sz});
+    }
+  }
+  // detach the miniheaps first, so the frees below go straight to
+  // their bitmaps rather than to our shuffle vectors
+  heap->releaseAll();
+
+  internal::vector<std::pair<char *, size_t>> live{};
+  for (size_t i = 0; i < ptrs.size(); i++) {
+    auto &ptr = ptrs[i];
+    if (i % 11 == 0) {
+      memset(ptr.first, static_cast<int>(live.size() % 251), ptr.second);
+      live.push_back(ptr);
+    } else {
+      gheap.free(ptr.first);
+    }
+  }
+
+  const auto before = gheap.getAllocatedMiniheapCount();
+  size_t unused = 0;
+  size_t len = sizeof(unused);
+  size_t workers = 4;
+  ASSERT_EQ(gheap.mallctl("mesh.compact", &unused, &len, &workers, sizeof(workers)), 0);
+  ASSERT_LT(gheap.getAllocatedMiniheapCount(), before);
+
+  // meshing doesn't move objects' virtual addresses
+  for (size_t i = 0; i < live.size(); i++) {
+    const auto ptr = live[i].first;
+    for (size_t j = 0; j < live[i].second; j++) {
+      ASSERT_EQ(ptr[j], static_cast<char>(i % 251));
+    }
+    gheap.free(ptr);
+  }
+  gheap.flushAllBins();
+}
@@ -0,0 +1,54 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <cstdint>
+
+#include "gtest/gtest.h"
+
+#include "page_map.h"
+
+using namespace mesh;
+
+TEST(PageMap, GetSet) {
+  PageMap map{};
+  static constexpr size_t Leaf = PageMap::kLeafPages;
+
+  // nothing is mapped before the arena grows over it
+  ASSERT_FALSE(map.get(0).hasValue());
+  ASSERT_FALSE(map.get(7 * Leaf + 3).hasValue());
+
+  // a span straddling two leaves
+  map.ensure(Leaf - 4, 8);
+  for (size_t i = 0; i < 8; i++) {
+    ASSERT_FALSE(map.get(Leaf - 4 + i).hasValue());
+    map.set(Leaf - 4 + i, MiniHeapID{static_cast<uint32_t>(i + 1)});
+  }
+  for (size_t i = 0; i < 8; i++) {
+    ASSERT_EQ(map.get(Leaf - 4 + i).value(), i + 1);
+  }
+  // the rest of both leaves is there, and unowned
+  ASSERT_FALSE(map.get(0).hasValue());
+  ASSERT_FALSE(map.get(2 * Leaf - 1).hasValue());
+  ASSERT_FALSE(map.get(2 * Leaf).hasValue());
+
+  // ensuring again keeps what's there
+  map.ensure(0, 3 * Leaf);
+  ASSERT_EQ(map.get(Leaf).value(), 5U);
+
+  // lookups through a cache agree, across leaves
+  PageMap::Cache cache{};
+  for (size_t i = 0; i < 8; i++) {
+    ASSERT_EQ(map.get(Leaf - 4 + i, cache).value(), i + 1);
+  }
+  ASSERT_EQ(cache.index, 1UL);
+  ASSERT_FALSE(map.get(9 * Leaf, cache).hasValue());
+  ASSERT_EQ(cache.index, 1UL);
+
+  // the last leaf of the arena
+  const Offset last = PageMap::kRootSize * Leaf - 1;
+  map.ensure(last, 1);
+  map.set(last, MiniHeapID{42});
+  ASSERT_EQ(map.get(last, cache).value(), 42U);
+}
@@ -0,0 +1,309 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "common.h"
+#include "internal.h"
+#include "thread_local_heap.h"
+
+using namespace mesh;
+
+TEST(ThreadLocalHeap, LargeCacheReuse) {
+  auto heap = ThreadLocalHeap::GetHeap();
+  GlobalHeap &gheap = runtime().heap();
+
+  const auto before = gheap.getAllocatedMiniheapCount();
+
+  static constexpr size_t Sz = 100 * 1024;
+  void *ptr1 = heap->malloc(Sz);
+  ASSERT_NE(ptr1, nullptr);
+  memset(ptr1, 'a', Sz);
+  MiniHeap *mh = gheap.miniheapFor(ptr1);
+  ASSERT_NE(mh, nullptr);
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), before + 1);
+
+  // the freed span stays cached (and indexed) ...
+  heap->free(ptr1);
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), before + 1);
+  ASSERT_EQ(gheap.miniheapFor(ptr1), mh);
+  ASSERT_TRUE(mh->isEmpty());
+
+  // ... and is handed back out for an allocation of the same page count
+  void *ptr2 = heap->malloc(Sz - 100);
+  ASSERT_EQ(ptr2, ptr1);
+  ASSERT_EQ(heap->getSize(ptr2), PageCount(Sz) * kPageSize);
+
+  // different page counts don't share bins
+  void *ptr3 = heap->malloc(Sz + kPageSize);
+  ASSERT_NE(ptr3, ptr1);
+
+  heap->free(ptr2);
+  heap->free(ptr3);
+
+  // anything larger than kMaxFastLargeSize isn't cached
+  void *ptr4 = heap->malloc(kMaxFastLargeSize + 1);
+  heap->free(ptr4);
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), before + 2);
+
+  heap->releaseAll();
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), before);
+}
+
+TEST(ThreadLocalHeap, ReallocGrowsLargeInPlace) {
+  auto heap = ThreadLocalHeap::GetHeap();
+  GlobalHeap &gheap = runtime().heap();
+
+  const auto before = gheap.getAllocatedMiniheapCount();
+
+  // bigger than any free span, so it is carved out of a fresh arena
+  // expansion (and certainly not served from the large cache)
+  size_t sz = 2 * kMinArenaExpansion * kPageSize;
+  char *ptr = reinterpret_cast<char *>(heap->malloc(sz));
+  ASSERT_NE(ptr, nullptr);
+  memset(ptr, 'a', sz);
+
+  // ptr is either followed by the rest of the expansion or at the end
+  // of the arena, so the pages right after it are free
+  char *grown = reinterpret_cast<char *>(heap->realloc(ptr, 2 * sz));
+  ASSERT_EQ(grown, ptr);
+  ASSERT_GE(heap->getSize(grown), 2 * sz);
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), before + 1);
+  for (size_t i = 0; i < sz; i++) {
+    ASSERT_EQ(grown[i], 'a');
+  }
+  memset(grown, 'b', 2 * sz);
+
+  // every page of the grown allocation maps to the same miniheap
+  MiniHeap *mh = gheap.miniheapFor(grown);
+  ASSERT_NE(mh, nullptr);
+  ASSERT_EQ(gheap.miniheapFor(grown + 2 * sz - 1), mh);
+
+  heap->free(grown);
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), before);
+}
+
+TEST(ThreadLocalHeap, LargeCallocIsZeroed) {
+  auto heap = ThreadLocalHeap::GetHeap();
+
+  static constexpr size_t Sz = 100 * 1024;
+
+  // the first allocation may come from clean pages; dirty the span
+  // and free it to the large cache
+  char *ptr = reinterpret_cast<char *>(heap->calloc(1, Sz));
+  ASSERT_NE(ptr, nullptr);
+  for (size_t i = 0; i < Sz; i++) {
+    ASSERT_EQ(ptr[i], 0);
+  }
+  memset(ptr, 'a', Sz);
+  heap->free(ptr);
+
+  // reusing the cached, dirty span must still hand back zeros
+  char *ptr2 = reinterpret_cast<char *>(heap->calloc(Sz / 1024, 1024));
+  ASSERT_EQ(ptr2, ptr);
+  for (size_t i = 0; i < Sz; i++) {
+    ASSERT_EQ(ptr2[i], 0);
+  }
+  memset(ptr2, 'b', Sz);
+  heap->free(ptr2);
+
+  // and so must spans freed back to the arena's dirty lists
+  heap->releaseAll();
+  char *ptr3 = reinterpret_cast<char *>(heap->calloc(1, Sz));
+  ASSERT_NE(ptr3, nullptr);
+  for (size_t i = 0; i < Sz; i++) {
+    ASSERT_EQ(ptr3[i], 0);
+  }
+  heap->free(ptr3);
+  heap->releaseAll();
+}
+
+TEST(ThreadLocalHeap, MemalignUsesSizeClasses) {
+  auto heap = ThreadLocalHeap::GetHeap();
+  GlobalHeap &gheap = runtime().heap();
+
+  for (size_t alignment = 16; alignment <= 256; alignment *= 2) {
+    for (size_t sz = 8; sz <= 1024; sz += 40) {
+      void *ptr = heap->memalign(alignment, sz);
+      ASSERT_NE(ptr, nullptr);
+      ASSERT_EQ(reinterpret_cast<uintptr_t>(ptr) % alignment, 0U);
+      ASSERT_GE(heap->getSize(ptr), sz);
+
+      // served from a shared, meshable size class rather than a
+      // dedicated single-object miniheap
+      MiniHeap *mh = gheap.miniheapFor(ptr);
+      ASSERT_NE(mh, nullptr);
+      ASSERT_GT(mh->maxCount(), 1U);
+
+      heap->free(ptr);
+    }
+  }
+
+  void *ptr = heap->memalign(64, 96);
+  ASSERT_EQ(heap->getSize(ptr), 128U);
+  heap->free(ptr);
+
+  heap->releaseAll();
+}
+
+TEST(ThreadLocalHeap, ParkAndAdopt) {
+  GlobalHeap &gheap = runtime().heap();
+  gheap.flushAllBins();
+
+  MiniHeap *parked = nullptr;
+  void *live = nullptr;
+
+  std::thread exiting([&]() {
+    auto heap = ThreadLocalHeap::GetHeap();
+    live = heap->malloc(64);
+    parked = gheap.miniheapFor(live);
+    heap->park();
+  });
+  exiting.join();
+
+  // still attached, but no longer to the exited thread
+  ASSERT_NE(parked, nullptr);
+  const pid_t id = parked->current();
+  ASSERT_GE(id, kParkedHeapIDBase);
+  ASSERT_LT(id, kTransferCacheID);
+
+  std::thread adopting([&]() {
+    auto heap = ThreadLocalHeap::GetHeap();
+    ASSERT_EQ(parked->current(), id);
+    // served from the adopted MiniHeaps without going to the global heap
+    void *ptr = heap->malloc(64);
+    ASSERT_EQ(gheap.miniheapFor(ptr)->current(), id);
+    heap->free(ptr);
+    heap->free(live);
+    heap->releaseAll();
+  });
+  adopting.join();
+
+  ASSERT_NE(parked->current(), id);
+  gheap.flushAllBins();
+}
+
+TEST(ThreadLocalHeap, HugePageRegion) {
+  auto heap = ThreadLocalHeap::GetHeap();
+  GlobalHeap &gheap = runtime().heap();
+
+  ASSERT_TRUE(gheap.enableHugePages());
+  ASSERT_TRUE(gheap.hugePagesEnabled());
+
+  static constexpr size_t Sz = 2 * kHugePageSize + kPageSize;
+
+  // large allocations come out of the huge page region, huge page
+  // aligned, and are never meshing candidates
+  char *ptr = reinterpret_cast<char *>(heap->malloc(Sz));
+  ASSERT_NE(ptr, nullptr);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(ptr) % kHugePageSize, 0UL);
+  MiniHeap *mh = gheap.miniheapFor(ptr);
+  ASSERT_NE(mh, nullptr);
+  ASSERT_TRUE(mh->isHugePage());
+  ASSERT_EQ(gheap.miniheapFor(ptr + Sz - 1), mh);
+  memset(ptr, 'a', Sz);
+  heap->free(ptr);
+  heap->releaseAll();
+
+  // freed spans are reused, and still zeroed by calloc
+  char *ptr2 = reinterpret_cast<char *>(heap->calloc(1, Sz));
+  ASSERT_EQ(ptr2, ptr);
+  for (size_t i = 0; i < Sz; i++) {
+    ASSERT_EQ(ptr2[i], 0);
+  }
+  memset(ptr2, 'b', Sz);
+  heap->free(ptr2);
+  heap->releaseAll();
+
+  // scavenging releases the whole huge pages of the free span
+  gheap.scavenge(true);
+  char *ptr3 = reinterpret_cast<char *>(heap->calloc(1, Sz));
+  ASSERT_EQ(ptr3, ptr);
+  for (size_t i = 0; i < Sz; i++) {
+    ASSERT_EQ(ptr3[i], 0);
+  }
+  heap->free(ptr3);
+  heap->releaseAll();
+
+  // small size classes stay in the file-backed arena unless asked for
+  void *small = heap->malloc(64);
+  ASSERT_FALSE(gheap.miniheapFor(small)->isHugePage());
+  heap->free(small);
+  heap->releaseAll();
+  gheap.flushAllBins();
+}
+
+TEST(ThreadLocalHeap, DirtyPageDecay) {
+  GlobalHeap &gheap = runtime().heap();
+
+  static constexpr size_t Sz = 16 * kPageSize;
+
+  gheap.scavenge(true);
+  gheap.setDirtyDecay(true);
+  const auto before = gheap.dirtyPageCount();
+
+  char *ptr = reinterpret_cast<char *>(gheap.malloc(Sz));
+  ASSERT_NE(ptr, nullptr);
+  memset(ptr, 'a', Sz);
+  gheap.free(ptr);
+
+  // freeing and a non-forced scavenge leave the pages dirty
+  ASSERT_EQ(gheap.dirtyPageCount(), before + Sz / kPageSize);
+  gheap.scavenge(false);
+  ASSERT_EQ(gheap.dirtyPageCount(), before + Sz / kPageSize);
+
+  // until they have aged kDirtyDecaySteps epochs
+  for (size_t i = 0; i + 1 < kDirtyDecaySteps; i++) {
+    gheap.decayScavenge();
+    ASSERT_EQ(gheap.dirtyPageCount(), before + Sz / kPageSize);
+  }
+  gheap.decayScavenge();
+  ASSERT_EQ(gheap.dirtyPageCount(), before);
+
+  // and come back zeroed
+  char *ptr2 = reinterpret_cast<char *>(gheap.malloc(Sz));
+  for (size_t i = 0; i < Sz; i++) {
+    ASSERT_EQ(ptr2[i], 0);
+  }
+  gheap.free(ptr2);
+
+  gheap.setDirtyDecay(false);
+  gheap.scavenge(true);
+}
+
+TEST(ThreadLocalHeap, ArenaSegments) {
+  GlobalHeap &gheap = runtime().heap();
+
+  static constexpr size_t Sz = 20ULL * 1024 * 1024 * 1024;  // 20 GB
+
+  // more than fits in the first segment: the arena maps the next one,
+  // contiguous with it
+  char *ptrs[4];
+  for (auto &ptr : ptrs) {
+    ptr = reinterpret_cast<char *>(gheap.malloc(Sz));
+    ASSERT_NE(ptr, nullptr);
+    ASSERT_TRUE(gheap.contains(ptr + Sz - 1));
+  }
+  ASSERT_GE(gheap.segmentCount(), 2UL);
+
+  char *last = ptrs[3];
+  ASSERT_GE(last + Sz, gheap.arenaBegin() + kArenaSize);
+  MiniHeap *mh = gheap.miniheapFor(last);
+  ASSERT_NE(mh, nullptr);
+  ASSERT_EQ(gheap.miniheapFor(last + Sz - 1), mh);
+  last[0] = 'a';
+  last[Sz - 1] = 'b';
+  ASSERT_EQ(last[0], 'a');
+  ASSERT_EQ(last[Sz - 1], 'b');
+
+  for (auto ptr : ptrs) {
+    gheap.free(ptr);
+  }
+  gheap.scavenge(true);
+}
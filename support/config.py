@@ -77,6 +77,8 @@ class ConfigBuilder:
                             help='0: no randomization. 1: freelist init only.  2: freelist init + free fastpath (default)')
         parser.add_argument('--disable-meshing', action='store_true', default=False,
                             help='disable meshing')
+        parser.add_argument('--per-cpu-heaps', action='store_true', default=False,
+                            help='share one heap per CPU (via rseq) rather than one per thread')
         parser.add_argument('--suffix', action='store_true', default=False,
                             help='always suffix the mesh binary with randomization + meshing info')
 
@@ -106,6 +108,11 @@ class ConfigBuilder:
         else:
             self.config_int('meshing-enabled', 1)
 
+        if args.per_cpu_heaps:
+            self.config_int('per-cpu-heaps', 1)
+        else:
+            self.config_int('per-cpu-heaps', 0)
+
         if args.suffix:
             suffix = str(args.randomization)
             if args.disable_meshing: